@@ -0,0 +1,121 @@
+#ifndef sonar_processing_BoundedQueue_hpp
+#define sonar_processing_BoundedQueue_hpp
+
+#include <deque>
+#include <pthread.h>
+
+namespace sonar_processing {
+
+/**
+ * Fixed capacity queue shared between threads.
+ * When the queue is full, pushing a new item drops the oldest one,
+ * so a slow consumer always works on the most recent data.
+ */
+template <typename T>
+class BoundedQueue {
+
+public:
+
+    BoundedQueue(size_t capacity = 1)
+        : capacity_(capacity > 0 ? capacity : 1)
+        , closed_(false)
+        , dropped_count_(0)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&not_empty_, NULL);
+    }
+
+    ~BoundedQueue() {
+        pthread_cond_destroy(&not_empty_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    /**
+     * Add an item to the queue. The item is ignored if the queue is closed.
+     * @return true if the oldest item was dropped to make room
+     */
+    bool push(const T& item) {
+        bool dropped = false;
+        pthread_mutex_lock(&mutex_);
+        if (closed_) {
+            pthread_mutex_unlock(&mutex_);
+            return false;
+        }
+
+        if (items_.size() >= capacity_) {
+            items_.pop_front();
+            dropped_count_++;
+            dropped = true;
+        }
+        items_.push_back(item);
+        pthread_cond_signal(&not_empty_);
+        pthread_mutex_unlock(&mutex_);
+        return dropped;
+    }
+
+    /**
+     * Wait for an item.
+     * @return false if the queue was closed
+     */
+    bool pop(T& item) {
+        pthread_mutex_lock(&mutex_);
+        while (items_.empty() && !closed_) {
+            pthread_cond_wait(&not_empty_, &mutex_);
+        }
+
+        if (closed_) {
+            pthread_mutex_unlock(&mutex_);
+            return false;
+        }
+
+        item = items_.front();
+        items_.pop_front();
+        pthread_mutex_unlock(&mutex_);
+        return true;
+    }
+
+    /**
+     * Wake up every waiting consumer and discard the pending items.
+     */
+    void close() {
+        pthread_mutex_lock(&mutex_);
+        closed_ = true;
+        items_.clear();
+        pthread_cond_broadcast(&not_empty_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    /**
+     * Accept items again, starting from an empty queue.
+     */
+    void open() {
+        pthread_mutex_lock(&mutex_);
+        closed_ = false;
+        items_.clear();
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    size_t dropped_count() {
+        pthread_mutex_lock(&mutex_);
+        size_t count = dropped_count_;
+        pthread_mutex_unlock(&mutex_);
+        return count;
+    }
+
+private:
+
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_;
+    size_t dropped_count_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t not_empty_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_BoundedQueue_hpp */
@@ -1,78 +1,159 @@
 #include "Denoising.hpp"
-#include "QualityMetrics.hpp"
+#include "FastMath.hpp"
 
 namespace sonar_processing {
 
 namespace denoising {
 
+// the RLS update of one row in the log domain, fused with the conversions
+static void rls_update_row(const float* src, float* w, float* dst, float* log_src, float p, int n) {
+    for (int j = 0; j < n; j++) {
+        float d = fast_math::log(src[j]);
+        float wj = w[j] + p * (d - w[j]);
+        log_src[j] = d;
+        w[j] = wj;
+        dst[j] = fast_math::exp(wj);
+    }
+}
+
+// the same update, also returning the squared error between the frame and the estimation
+static float rls_update_row_error(const float* src, float* w, float* dst, float* log_src, float p, int n) {
+    float error = 0;
+    for (int j = 0; j < n; j++) {
+        float d = fast_math::log(src[j]);
+        float wj = w[j] + p * (d - w[j]);
+        float e = fast_math::exp(wj);
+        log_src[j] = d;
+        w[j] = wj;
+        dst[j] = e;
+        error += (src[j] - e) * (src[j] - e);
+    }
+    return error;
+}
+
+// remove the measurement of one row from the estimation
+static void rls_downdate_row(const float* oldest_log, float* w, float p, int n) {
+    for (int j = 0; j < n; j++) {
+        w[j] = w[j] - p * (oldest_log[j] - w[j]);
+    }
+}
+
 // Standard Recursive Least Square Filter algorithm
 cv::Mat RLS::infinite_window(const cv::Mat& src) {
     CV_Assert(src.depth() == CV_32F);
-    cv::Mat dst;
+    return update(src, NULL, NULL);
+}
+
+// update the estimation, store the log of the frame and compute the error if requested
+cv::Mat RLS::update(const cv::Mat& src, cv::Mat* log_src, double* mse) {
+    cv::Mat dst(src.size(), src.type());
+    const int n = src.cols * src.channels();
+
+    if (mse)
+        *mse = 0;
 
     // initialize coefficients
-    if (rls_p.empty() || rls_w.empty() || src.size() != rls_p.size()) {
-        rls_p = cv::Mat::ones(src.size(), CV_32F);
-        src.copyTo(rls_w);
+    if (rls_w.empty() || src.size() != rls_w.size() || src.type() != rls_w.type()) {
+        rls_p = 1;
+        rls_w.create(src.size(), src.type());
+        for (int i = 0; i < src.rows; i++) {
+            const float* s = src.ptr<float>(i);
+            float* w = rls_w.ptr<float>(i);
+            for (int j = 0; j < n; j++) w[j] = fast_math::log(s[j]);
+        }
         src.copyTo(dst);
-        frames.clear();
+        frames_count = 0;
     }
 
     // estimation of w parameters and its covariance p
     else {
-        // convert image to linear space
-        cv::Mat rls_d;
-        cv::log(src, rls_d);
-
-        for (size_t i = 0; i < rls_w.rows; i++) {
-            for (size_t j = 0; j < rls_w.cols; j++) {
-                float p = rls_p.at<float>(i, j);
-                float w = rls_w.at<float>(i, j);
-                float d = rls_d.at<float>(i, j);
-                p = p - ((p * p) / (1 + p));
-                w = w + p * (d - w);
-
-                rls_p.at<float>(i, j) = p;
-                rls_w.at<float>(i, j) = w;
+        // the covariance starts at 1 for every pixel and follows the same recursion
+        rls_p = rls_p - ((rls_p * rls_p) / (1 + rls_p));
+
+        // without a history, the log of each row goes to a scratch row
+        if (!log_src)
+            log_row.resize(n);
+
+        // the error is estimated on one row out of mse_step
+        double error = 0;
+        size_t error_count = 0;
+
+        for (int i = 0; i < src.rows; i++) {
+            float* d = (log_src) ? log_src->ptr<float>(i) : &log_row[0];
+
+            if (mse && i % mse_step == 0) {
+                error += rls_update_row_error(src.ptr<float>(i), rls_w.ptr<float>(i), dst.ptr<float>(i), d, rls_p, n);
+                error_count += n;
+            }
+            else {
+                rls_update_row(src.ptr<float>(i), rls_w.ptr<float>(i), dst.ptr<float>(i), d, rls_p, n);
             }
         }
 
-        // convert back to nonlinear space
-        cv::exp(rls_w, dst);
+        if (mse && error_count)
+            *mse = error / error_count;
     }
     return dst;
 }
 
+// remove the oldest measurement
+void RLS::downdate(const cv::Mat& oldest_log) {
+    if (rls_w.empty() || oldest_log.size() != rls_w.size() || oldest_log.type() != rls_w.type())
+        return;
+
+    rls_p = rls_p + ((rls_p * rls_p) / (1 - rls_p));
+
+    const int n = oldest_log.cols * oldest_log.channels();
+    for (int i = 0; i < oldest_log.rows; i++) {
+        rls_downdate_row(oldest_log.ptr<float>(i), rls_w.ptr<float>(i), rls_p, n);
+    }
+}
+
+// reserve the next slot of the frame history, it grows only when the window does
+cv::Mat& RLS::push_frame(const cv::Mat& src) {
+    if (frames_count == log_frames.size()) {
+        std::vector<cv::Mat> frames(std::max<size_t>(window_size, frames_count + 1));
+        for (size_t k = 0; k < frames_count; k++)
+            frames[k] = log_frames[(frames_begin + k) % log_frames.size()];
+
+        log_frames.swap(frames);
+        frames_begin = 0;
+    }
+
+    cv::Mat& slot = log_frames[(frames_begin + frames_count) % log_frames.size()];
+    slot.create(src.size(), src.type());
+    frames_count++;
+    return slot;
+}
+
+// remove the oldest frame of the history
+void RLS::pop_frame() {
+    frames_begin = (frames_begin + 1) % log_frames.size();
+    frames_count--;
+}
+
+// the oldest frame of the history, in the log domain
+const cv::Mat& RLS::oldest_frame() const {
+    return log_frames[frames_begin];
+}
+
 // Recursive Least Square Filter algorithm with fixed data window
 cv::Mat RLS::sliding_window(const cv::Mat& src) {
     CV_Assert(src.depth() == CV_32F);
+    return slide(src, NULL);
+}
 
+// move the window to the new frame
+cv::Mat RLS::slide(const cv::Mat& src, double* mse) {
     // check for downdate
-    if (frames.size() == window_size) {
-        cv::Mat oldest;
-        cv::log(frames.front(), oldest);
-        frames.pop_front();
-
-        // remove old measurement
-        for (size_t i = 0; i < rls_w.rows; i++) {
-            for (size_t j = 0; j < rls_w.cols; j++) {
-                float p = rls_p.at<float>(i, j);
-                float w = rls_w.at<float>(i, j);
-                float oldest_d = oldest.at<float>(i, j);
-                p = p + ((p * p) / (1 - p));
-                w = w - p * (oldest_d - w);
-
-                rls_p.at<float>(i, j) = p;
-                rls_w.at<float>(i, j) = w;
-            }
-        }
+    if (frames_count && frames_count == window_size) {
+        downdate(oldest_frame());
+        pop_frame();
     }
 
-    // store current frame
-    frames.push_back(src.clone());
-
-    // update coefficients
-    return infinite_window(src);
+    // store current frame in the log domain and update coefficients
+    cv::Mat& log_src = push_frame(src);
+    return update(src, &log_src, mse);
 }
 
 // Recursive Least Square Filter algorithm with dynamic data window size
@@ -80,32 +161,17 @@ cv::Mat RLS::adaptive_window(const cv::Mat& src) {
     CV_Assert(src.depth() == CV_32F);
 
     // if window size is higher than frame size, decrease 1x
-    if (frames.size() > window_size) {
-        cv::Mat oldest;
-        cv::log(frames.front(), oldest);
-        frames.pop_front();
-
-        // remove old measurement
-        for (size_t i = 0; i < rls_w.rows; i++) {
-            for (size_t j = 0; j < rls_w.cols; j++) {
-                float p = rls_p.at<float>(i, j);
-                float w = rls_w.at<float>(i, j);
-                float oldest_d = oldest.at<float>(i, j);
-                p = p + ((p * p) / (1 - p));
-                w = w - p * (oldest_d - w);
-
-                rls_p.at<float>(i, j) = p;
-                rls_w.at<float>(i, j) = w;
-            }
-        }
+    if (frames_count > window_size) {
+        downdate(oldest_frame());
+        pop_frame();
     }
 
-    // run sliding window and update coefficients
-    cv::Mat dst = sliding_window(src);
+    // run sliding window and update coefficients, computing the error in the same pass
+    double mse_i = 0;
+    cv::Mat dst = slide(src, &mse_i);
 
     // adaptative window size
-    double mse_i = qs::MSE(src, dst);
-    if (!mse_0 && mse_i && frames.size() == window_size) mse_0 = mse_i;
+    if (!mse_0 && mse_i && frames_count == window_size) mse_0 = mse_i;
     if (mse_0) {
         if ((mse_i <= mse_0) && (window_size < 10)) window_size++;
         if ((mse_i > mse_0) && (window_size > 2)) window_size--;
@@ -113,30 +179,157 @@ cv::Mat RLS::adaptive_window(const cv::Mat& src) {
     return dst;
 }
 
+// the angular distance between two beams
+static float beam_step(int beam_count, float first_bearing, float last_bearing) {
+    return (beam_count > 1) ? (last_bearing - first_bearing) / (beam_count - 1) : 1;
+}
+
+// Recursive average of polar frames with motion compensation
+cv::Mat PolarTemporalFilter::apply(const cv::Mat& src, float _first_bearing, float _last_bearing, const Motion& motion) {
+    CV_Assert(src.type() == CV_32FC1);
+    cv::Mat dst(src.size(), CV_32F);
+
+    // initialize the state with the frame
+    if (state.empty() || src.size() != state.size() || _first_bearing != first_bearing || _last_bearing != last_bearing) {
+        first_bearing = _first_bearing;
+        last_bearing = _last_bearing;
+
+        float step = beam_step(src.rows, first_bearing, last_bearing);
+        beam_cos.resize(src.rows);
+        beam_sin.resize(src.rows);
+        for (int b = 0; b < src.rows; b++) {
+            beam_cos[b] = cos(first_bearing + b * step);
+            beam_sin[b] = sin(first_bearing + b * step);
+        }
+
+        cv::Mat channels[] = { src, cv::Mat::ones(src.size(), CV_32F) };
+        cv::merge(channels, 2, state);
+        src.copyTo(dst);
+        return dst;
+    }
+
+    warp(motion);
+
+    // the bins moved from outside the previous frame have no history and restart from the frame
+    const float max_count = window_size;
+    for (int i = 0; i < src.rows; i++) {
+        const float* s = src.ptr<float>(i);
+        float* st = state.ptr<float>(i);
+        float* d = dst.ptr<float>(i);
+
+        for (int j = 0; j < src.cols; j++) {
+            float n = std::min(st[2 * j + 1] + 1.0f, max_count);
+            float v = st[2 * j] + (s[j] - st[2 * j]) / n;
+            st[2 * j] = v;
+            st[2 * j + 1] = n;
+            d[j] = v;
+        }
+    }
+    return dst;
+}
+
+// Recursive average of polar frames with estimated motion
+cv::Mat PolarTemporalFilter::apply(const cv::Mat& src, float _first_bearing, float _last_bearing) {
+    return apply(src, _first_bearing, _last_bearing, estimate_motion(src, _first_bearing, _last_bearing));
+}
+
+// estimate the motion by phase correlation on the downsampled frames
+PolarTemporalFilter::Motion PolarTemporalFilter::estimate_motion(const cv::Mat& src, float _first_bearing, float _last_bearing) {
+    CV_Assert(src.type() == CV_32FC1);
+
+    cv::Mat small;
+    cv::resize(src, small, cv::Size(), estimation_scale, estimation_scale, cv::INTER_AREA);
+
+    if (previous_small.empty() || previous_small.size() != small.size() || small.rows < 2 || small.cols < 2) {
+        small.copyTo(previous_small);
+        return Motion();
+    }
+
+    if (hanning.size() != small.size())
+        cv::createHanningWindow(hanning, small.size(), CV_32F);
+
+    // the shift of the content from the previous frame to the current one
+    cv::Point2d shift = cv::phaseCorrelate(previous_small, small, hanning);
+    cv::swap(previous_small, small);
+
+    double bins = shift.x * src.cols / previous_small.cols;
+    double beams = shift.y * src.rows / previous_small.rows;
+
+    // the content moves against the sonar motion
+    return Motion(-bins, 0, -beams * beam_step(src.rows, _first_bearing, _last_bearing));
+}
+
+// forget the previous frames
+void PolarTemporalFilter::reset() {
+    state.release();
+    previous_small.release();
+}
+
+// move the state to the current sonar pose with one remap
+void PolarTemporalFilter::warp(const Motion& motion) {
+    if (!motion.dx && !motion.dy && !motion.dyaw)
+        return;
+
+    const float step = beam_step(state.rows, first_bearing, last_bearing);
+    const float c = cos(motion.dyaw);
+    const float s = sin(motion.dyaw);
+
+    map_x.create(state.size(), CV_32F);
+    map_y.create(state.size(), CV_32F);
+
+    for (int b = 0; b < state.rows; b++) {
+        float* mx = map_x.ptr<float>(b);
+        float* my = map_y.ptr<float>(b);
+
+        for (int k = 0; k < state.cols; k++) {
+            // the bin position in the previous frame
+            float x = k * beam_cos[b];
+            float y = k * beam_sin[b];
+            float px = c * x - s * y + motion.dx;
+            float py = s * x + c * y + motion.dy;
+
+            mx[k] = sqrtf(px * px + py * py);
+            my[k] = (atan2f(py, px) - first_bearing) / step;
+        }
+    }
+
+    cv::remap(state, warped_state, map_x, map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0));
+    cv::swap(state, warped_state);
+}
+
 // Homomorphic Filtering with the log function
-void homomorphic_filter(cv::InputArray _src, cv::OutputArray _dst, int iterations) {
+void HomomorphicFilter::apply(cv::InputArray _src, cv::OutputArray _dst) {
     cv::Mat src = _src.getMat();
-    cv::Mat mat;
-    src.copyTo(mat);
+    CV_Assert(src.depth() == CV_8U || src.depth() == CV_32F);
 
-    // check image depth
-    if (mat.depth() == CV_8U)
-        mat.convertTo(mat, CV_32F, 1.0 / 255.0);
+    // The median selects one of the window values and commutes with the monotonic
+    // log, exp and 8 bits quantization, so exp(median^n(log(x))) is median^n(x)
+    // and the iterations run on the 8 bits image with the histogram median.
+    cv::Mat input = src;
+    if (src.depth() != CV_8U) {
+        src.convertTo(buffers[1], CV_8U, 255);
+        input = buffers[1];
+    }
 
-    // apply n iterations of the algoritm
-    mat.copyTo(_dst);
-    cv::Mat dst = _dst.getMat();
+    if (iterations <= 0) {
+        input.copyTo(_dst);
+        return;
+    }
 
-    for (size_t i = 0; i < iterations; i++) {
-        if (i > 1) dst.copyTo(mat);
-        cv::Mat result;
-        cv::log(mat, result);
-        cv::medianBlur(result, result, 5);
-        cv::exp(result, result);
-        result.copyTo(dst);
+    // each iteration filters the result of the previous one
+    int current = 0;
+    cv::medianBlur(input, buffers[current], 5);
+    for (int i = 1; i < iterations; i++) {
+        cv::medianBlur(buffers[current], buffers[1 - current], 5);
+        current = 1 - current;
     }
 
-    dst.convertTo(dst, CV_8UC1, 255);
+    buffers[current].copyTo(_dst);
+}
+
+// Homomorphic Filtering with the log function
+void homomorphic_filter(cv::InputArray _src, cv::OutputArray _dst, int iterations) {
+    HomomorphicFilter(iterations).apply(_src, _dst);
 }
 
 } /* namespace denoising */
@@ -3,7 +3,7 @@
 
 #include <stdio.h>
 #include <opencv2/opencv.hpp>
-#include <deque>
+#include <vector>
 
 namespace sonar_processing {
 
@@ -16,16 +16,22 @@ public:
     RLS()
         : rls_w()
         , rls_p()
-        , frames()
+        , log_frames()
+        , frames_begin(0)
+        , frames_count(0)
         , window_size(8)
+        , mse_step(1)
         , mse_0(0)
         {};
 
     RLS(unsigned int _window_size)
         : rls_w()
         , rls_p()
-        , frames()
+        , log_frames()
+        , frames_begin(0)
+        , frames_count(0)
         , window_size(_window_size)
+        , mse_step(1)
         , mse_0(0)
         {};
 
@@ -36,15 +42,192 @@ public:
     cv::Mat adaptive_window(const cv::Mat& src);
     void setWindow_size(uint value) { window_size = value; };
     uint getWindow_size() { return window_size; };
-    uint getBuffer_size() { return frames.size(); };
+    uint getBuffer_size() { return frames_count; };
+
+    // the adaptive window estimates its error on one row out of value
+    void setMse_step(uint value) { mse_step = value ? value : 1; };
+    uint getMse_step() { return mse_step; };
 
 protected:
-    cv::Mat rls_w, rls_p;
-    std::deque<cv::Mat> frames;
+    /**
+     * Update the estimation with a new frame.
+     * @param src: the new frame
+     * @param log_src: receives the frame in the log domain, if not NULL
+     * @param mse: receives the mean squared error of the estimation, if not NULL
+     * @return the estimated frame
+     */
+    cv::Mat update(const cv::Mat& src, cv::Mat* log_src, double* mse);
+
+    /**
+     * Run the sliding window.
+     * @param src: the new frame
+     * @param mse: receives the mean squared error of the estimation, if not NULL
+     * @return the estimated frame
+     */
+    cv::Mat slide(const cv::Mat& src, double* mse);
+
+    /**
+     * Remove the oldest measurement from the estimation.
+     * @param oldest_log: the oldest frame in the window, in the log domain
+     */
+    void downdate(const cv::Mat& oldest_log);
+
+    /**
+     * Add a frame slot to the history.
+     * @return the slot, allocated with the size and type of src
+     */
+    cv::Mat& push_frame(const cv::Mat& src);
+    void pop_frame();
+    const cv::Mat& oldest_frame() const;
+
+    // the weights, in the log domain
+    cv::Mat rls_w;
+
+    // the covariance, the same for every pixel
+    float rls_p;
+
+    // the frames of the window in the log domain, a ring buffer reused between frames
+    std::vector<cv::Mat> log_frames;
+    size_t frames_begin;
+    size_t frames_count;
+
+    // the log of one row, when there is no history
+    std::vector<float> log_row;
+
     uint window_size;
+    uint mse_step;
     double mse_0;
 };
 
+// Recursive temporal average of polar frames with motion compensation
+class PolarTemporalFilter {
+
+public:
+    /**
+     * The rigid motion of the sonar since the previous frame, as the pose of
+     * the current frame in the previous one. The x axis is the zero bearing,
+     * the translation is in bins and the rotation in radians.
+     */
+    struct Motion {
+        Motion()
+            : dx(0)
+            , dy(0)
+            , dyaw(0)
+            {};
+
+        Motion(float _dx, float _dy, float _dyaw)
+            : dx(_dx)
+            , dy(_dy)
+            , dyaw(_dyaw)
+            {};
+
+        float dx, dy, dyaw;
+    };
+
+    PolarTemporalFilter()
+        : state()
+        , first_bearing(0)
+        , last_bearing(0)
+        , window_size(8)
+        , estimation_scale(0.25)
+        {};
+
+    PolarTemporalFilter(unsigned int _window_size)
+        : state()
+        , first_bearing(0)
+        , last_bearing(0)
+        , window_size(_window_size)
+        , estimation_scale(0.25)
+        {};
+
+    ~PolarTemporalFilter(){};
+
+    /**
+     * Average the frame with the previous ones, moved to the current sonar pose.
+     * @param src: the polar frame, one row of bins per beam, CV_32F
+     * @param _first_bearing: the bearing of the first beam, in radians
+     * @param _last_bearing: the bearing of the last beam, in radians, the beams are equally spaced
+     * @param motion: the motion since the previous frame
+     * @return the filtered frame
+     */
+    cv::Mat apply(const cv::Mat& src, float _first_bearing, float _last_bearing, const Motion& motion);
+
+    /**
+     * Average the frame with the previous ones, with the motion estimated by estimate_motion.
+     */
+    cv::Mat apply(const cv::Mat& src, float _first_bearing, float _last_bearing);
+
+    /**
+     * Estimate the motion since the previous frame by phase correlation of the
+     * downsampled polar frames. A rotation shifts the beams and a translation
+     * along the zero bearing shifts the bins, so this holds for small motions.
+     * @return a null motion for the first frame
+     */
+    Motion estimate_motion(const cv::Mat& src, float _first_bearing, float _last_bearing);
+
+    // forget the previous frames
+    void reset();
+
+    void setWindow_size(uint value) { window_size = value ? value : 1; };
+    uint getWindow_size() { return window_size; };
+    void setEstimation_scale(double value) { estimation_scale = value; };
+    double getEstimation_scale() { return estimation_scale; };
+
+protected:
+    /**
+     * Move the state to the current sonar pose.
+     */
+    void warp(const Motion& motion);
+
+    // the average and the number of averaged frames of each bin, CV_32FC2
+    cv::Mat state;
+    cv::Mat warped_state;
+
+    // the position in the previous frame of each bin of the current one
+    cv::Mat map_x, map_y;
+
+    // the direction of each beam
+    std::vector<float> beam_cos, beam_sin;
+    float first_bearing, last_bearing;
+
+    // the downsampled previous frame used by the motion estimation
+    cv::Mat previous_small;
+    cv::Mat hanning;
+
+    uint window_size;
+    double estimation_scale;
+};
+
+// Homomorphic filter with a median in the log domain
+class HomomorphicFilter {
+
+public:
+    HomomorphicFilter()
+        : iterations(1)
+        {};
+
+    HomomorphicFilter(int _iterations)
+        : iterations(_iterations)
+        {};
+
+    ~HomomorphicFilter(){};
+
+    /**
+     * Apply log, the median filters and exp.
+     * @param _src: the image, CV_8U or CV_32F in [0, 1]
+     * @param _dst: the filtered image, CV_8U
+     */
+    void apply(cv::InputArray _src, cv::OutputArray _dst);
+
+    void setIterations(int value) { iterations = value; };
+    int getIterations() { return iterations; };
+
+protected:
+    // the ping-pong buffers of the iterations, reused between frames
+    cv::Mat buffers[2];
+    int iterations;
+};
+
 void homomorphic_filter(cv::InputArray _src, cv::OutputArray _dst, int iterations);
 
 } /* namespace denoising */
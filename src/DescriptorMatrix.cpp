@@ -0,0 +1,122 @@
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "DescriptorMatrix.hpp"
+
+namespace sonar_processing {
+
+DescriptorMatrix::DescriptorMatrix()
+    : file_(NULL)
+    , mapped_data_(NULL)
+    , mapped_size_(0)
+    , rows_(0)
+    , cols_(0)
+{
+}
+
+DescriptorMatrix::~DescriptorMatrix() {
+    // a matrix that was never closed was left behind by a failure
+    if (file_) {
+        Remove();
+    }
+}
+
+void DescriptorMatrix::Create(const std::string& filename, int cols) {
+    CV_Assert(cols > 0);
+
+    Close();
+
+    file_ = fopen(filename.c_str(), "w+b");
+
+    if (!file_) {
+        throw std::runtime_error("failed to create the descriptor matrix file " + filename);
+    }
+
+    filename_ = filename;
+    cols_ = cols;
+    rows_ = 0;
+    labels_.clear();
+}
+
+void DescriptorMatrix::Append(const std::vector<float>& data, int label) {
+    if (data.empty()) {
+        return;
+    }
+
+    CV_Assert(data.size() % cols_ == 0);
+    Append(&data[0], data.size() / cols_, label);
+}
+
+void DescriptorMatrix::Append(const float* data, int rows, int label) {
+    CV_Assert(file_);
+
+    if (rows <= 0) {
+        return;
+    }
+
+    Unmap();
+
+    size_t count = (size_t)rows * cols_;
+    if (fwrite(data, sizeof(float), count, file_) != count) {
+        throw std::runtime_error("failed to write the descriptor matrix file " + filename_);
+    }
+
+    rows_ += rows;
+    labels_.insert(labels_.end(), rows, label);
+}
+
+cv::Mat DescriptorMatrix::Map() {
+    CV_Assert(file_);
+
+    if (rows_ == 0) {
+        return cv::Mat();
+    }
+
+    if (!mapped_data_) {
+        fflush(file_);
+
+        mapped_size_ = (size_t)rows_ * cols_ * sizeof(float);
+        mapped_data_ = mmap(NULL, mapped_size_, PROT_READ, MAP_SHARED, fileno(file_), 0);
+
+        if (mapped_data_ == MAP_FAILED) {
+            mapped_data_ = NULL;
+            mapped_size_ = 0;
+            throw std::runtime_error("failed to map the descriptor matrix file " + filename_);
+        }
+
+        // the trainers visit the rows in a shuffled order, so read ahead only wastes page-ins
+        madvise(mapped_data_, mapped_size_, MADV_RANDOM);
+    }
+
+    return cv::Mat(rows_, cols_, CV_32FC1, mapped_data_);
+}
+
+void DescriptorMatrix::Close() {
+    Unmap();
+
+    if (file_) {
+        fclose(file_);
+        file_ = NULL;
+    }
+}
+
+void DescriptorMatrix::Remove() {
+    Close();
+
+    if (!filename_.empty()) {
+        unlink(filename_.c_str());
+    }
+
+    rows_ = 0;
+    labels_.clear();
+}
+
+void DescriptorMatrix::Unmap() {
+    if (mapped_data_) {
+        munmap(mapped_data_, mapped_size_);
+        mapped_data_ = NULL;
+        mapped_size_ = 0;
+    }
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,95 @@
+#ifndef sonar_processing_DescriptorMatrix_hpp
+#define sonar_processing_DescriptorMatrix_hpp
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Row-major float matrix stored in a file.
+ * The descriptors are appended to the file as they are produced and the
+ * file is memory mapped to be used as training data, so the whole data set
+ * never needs to be held in memory.
+ * The file is deleted if the matrix is destroyed before Close or Remove is
+ * called, so an interrupted training does not leave it on the disk.
+ */
+class DescriptorMatrix {
+
+public:
+
+    DescriptorMatrix();
+    ~DescriptorMatrix();
+
+    /**
+     * Create an empty matrix file, truncating any existing one.
+     * @param filename: the matrix file path
+     * @param cols: the descriptor size
+     */
+    void Create(const std::string& filename, int cols);
+
+    /**
+     * Append rows to the end of the matrix.
+     * @param data: the row values, its size must be a multiple of cols
+     * @param label: the label of every appended row
+     */
+    void Append(const std::vector<float>& data, int label);
+
+    void Append(const float* data, int rows, int label);
+
+    /**
+     * Map the file in memory.
+     * @return a rows x cols CV_32FC1 header over the mapped data, valid until
+     * the next Append, Close or Remove call
+     */
+    cv::Mat Map();
+
+    /**
+     * Unmap and close the file. The file is kept on the disk.
+     */
+    void Close();
+
+    /**
+     * Close and delete the file.
+     */
+    void Remove();
+
+    int rows() const {
+        return rows_;
+    }
+
+    int cols() const {
+        return cols_;
+    }
+
+    const std::vector<int>& labels() const {
+        return labels_;
+    }
+
+    const std::string& filename() const {
+        return filename_;
+    }
+
+private:
+
+    DescriptorMatrix(const DescriptorMatrix&);
+    DescriptorMatrix& operator=(const DescriptorMatrix&);
+
+    void Unmap();
+
+    std::string filename_;
+    FILE* file_;
+
+    void* mapped_data_;
+    size_t mapped_size_;
+
+    int rows_;
+    int cols_;
+    std::vector<int> labels_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_DescriptorMatrix_hpp */
@@ -0,0 +1,228 @@
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+#include "DetectionClustering.hpp"
+
+namespace sonar_processing {
+
+namespace {
+
+struct WeightGreater {
+    WeightGreater(const std::vector<double>& weights) : weights_(weights) {}
+
+    bool operator() (int i, int j) const { return weights_[i] > weights_[j]; }
+
+private:
+    const std::vector<double>& weights_;
+};
+
+inline size_t grid_hash(int cx, int cy, size_t bucket_count) {
+    return (((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u)) % bucket_count;
+}
+
+inline int find_root(std::vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+inline float half_diagonal(const cv::RotatedRect& rc) {
+    return 0.5f * sqrt(rc.size.width * rc.size.width + rc.size.height * rc.size.height);
+}
+
+} /* namespace */
+
+DetectionClustering::DetectionClustering()
+    : overlap_threshold_(0.3)
+    , max_results_(10)
+    , box_fusion_enable_(false)
+{
+}
+
+DetectionClustering::~DetectionClustering() {
+}
+
+void DetectionClustering::Apply(
+    const std::vector<cv::RotatedRect>& locations,
+    const std::vector<double>& weights,
+    std::vector<cv::RotatedRect>& result_locations,
+    std::vector<double>& result_weights) const
+{
+    CV_Assert(locations.size() == weights.size());
+
+    std::vector<int> cluster_ids;
+    BuildClusters(locations, cluster_ids);
+
+    // the best candidate of each cluster
+    const int n = (int)locations.size();
+    std::vector<int> cluster_slot(n, -1);
+    std::vector<int> cluster_best;
+    std::vector<std::vector<int> > cluster_members;
+
+    for (int i = 0; i < n; i++) {
+        int& slot = cluster_slot[cluster_ids[i]];
+
+        if (slot < 0) {
+            slot = (int)cluster_best.size();
+            cluster_best.push_back(i);
+            if (box_fusion_enable_) cluster_members.push_back(std::vector<int>());
+        }
+        else if (weights[i] > weights[cluster_best[slot]]) {
+            cluster_best[slot] = i;
+        }
+
+        if (box_fusion_enable_) cluster_members[slot].push_back(i);
+    }
+
+    // only the clusters are ranked
+    std::vector<int> order(cluster_best.size());
+    for (size_t k = 0; k < order.size(); k++) order[k] = (int)k;
+
+    std::vector<double> cluster_weights(cluster_best.size());
+    for (size_t k = 0; k < cluster_best.size(); k++) cluster_weights[k] = weights[cluster_best[k]];
+
+    size_t count = order.size();
+    if (max_results_ > 0 && max_results_ < count) count = max_results_;
+
+    std::partial_sort(order.begin(), order.begin() + count, order.end(), WeightGreater(cluster_weights));
+
+    std::vector<cv::RotatedRect> new_locations(count);
+    std::vector<double> new_weights(count);
+
+    for (size_t k = 0; k < count; k++) {
+        int slot = order[k];
+        new_weights[k] = cluster_weights[slot];
+        new_locations[k] = (box_fusion_enable_) ?
+            FuseCluster(locations, weights, cluster_members[slot]) :
+            locations[cluster_best[slot]];
+    }
+
+    result_locations.swap(new_locations);
+    result_weights.swap(new_weights);
+}
+
+double DetectionClustering::Overlap(const cv::RotatedRect& a, const cv::RotatedRect& b) {
+    double area_a = a.size.width * a.size.height;
+    double area_b = b.size.width * b.size.height;
+
+    if (area_a <= 0 || area_b <= 0) {
+        return 0;
+    }
+
+    // the circumscribed circles do not touch
+    cv::Point2f d = a.center - b.center;
+    float r = half_diagonal(a) + half_diagonal(b);
+    if (d.x * d.x + d.y * d.y > r * r) {
+        return 0;
+    }
+
+    cv::Point2f pa[4];
+    cv::Point2f pb[4];
+    a.points(pa);
+    b.points(pb);
+
+    std::vector<cv::Point2f> poly_a(pa, pa + 4);
+    std::vector<cv::Point2f> poly_b(pb, pb + 4);
+    std::vector<cv::Point2f> intersection;
+    double area = cv::intersectConvexConvex(poly_a, poly_b, intersection);
+
+    if (area <= 0) {
+        return 0;
+    }
+
+    return area / (area_a + area_b - area);
+}
+
+void DetectionClustering::BuildClusters(
+    const std::vector<cv::RotatedRect>& locations,
+    std::vector<int>& cluster_ids) const
+{
+    const int n = (int)locations.size();
+
+    std::vector<int> parent(n);
+    for (int i = 0; i < n; i++) parent[i] = i;
+
+    // two overlapping candidates are at most one cell apart
+    float cell_size = 0;
+    for (int i = 0; i < n; i++) cell_size = std::max(cell_size, 2 * half_diagonal(locations[i]));
+    if (cell_size <= 0) cell_size = 1;
+
+    const size_t bucket_count = 2 * n + 1;
+    std::vector<std::vector<int> > buckets(bucket_count);
+    std::vector<int> cx(n);
+    std::vector<int> cy(n);
+
+    for (int i = 0; i < n; i++) {
+        cx[i] = (int)floor(locations[i].center.x / cell_size);
+        cy[i] = (int)floor(locations[i].center.y / cell_size);
+        buckets[grid_hash(cx[i], cy[i], bucket_count)].push_back(i);
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                const std::vector<int>& bucket = buckets[grid_hash(cx[i] + dx, cy[i] + dy, bucket_count)];
+
+                for (size_t k = 0; k < bucket.size(); k++) {
+                    int j = bucket[k];
+
+                    // each pair is tested once and hash collisions are skipped
+                    if (j <= i || cx[j] != cx[i] + dx || cy[j] != cy[i] + dy) {
+                        continue;
+                    }
+
+                    int root_i = find_root(parent, i);
+                    int root_j = find_root(parent, j);
+
+                    if (root_i != root_j && Overlap(locations[i], locations[j]) >= overlap_threshold_) {
+                        parent[root_j] = root_i;
+                    }
+                }
+            }
+        }
+    }
+
+    cluster_ids.resize(n);
+    for (int i = 0; i < n; i++) cluster_ids[i] = find_root(parent, i);
+}
+
+cv::RotatedRect DetectionClustering::FuseCluster(
+    const std::vector<cv::RotatedRect>& locations,
+    const std::vector<double>& weights,
+    const std::vector<int>& members) const
+{
+    double sum = 0;
+    double x = 0, y = 0, w = 0, h = 0;
+    double sin_sum = 0, cos_sum = 0;
+
+    for (size_t k = 0; k < members.size(); k++) {
+        const cv::RotatedRect& rc = locations[members[k]];
+        double weight = std::max(weights[members[k]], 0.0);
+
+        // the angle is averaged on the doubled angle, a box is the same after 180 degrees
+        double theta = 2.0 * rc.angle * CV_PI / 180.0;
+
+        x += weight * rc.center.x;
+        y += weight * rc.center.y;
+        w += weight * rc.size.width;
+        h += weight * rc.size.height;
+        sin_sum += weight * sin(theta);
+        cos_sum += weight * cos(theta);
+        sum += weight;
+    }
+
+    if (sum <= 0) {
+        int best = members[0];
+        for (size_t k = 1; k < members.size(); k++) {
+            if (weights[members[k]] > weights[best]) best = members[k];
+        }
+        return locations[best];
+    }
+
+    double angle = 0.5 * atan2(sin_sum, cos_sum) * 180.0 / CV_PI;
+    return cv::RotatedRect(cv::Point2f(x / sum, y / sum), cv::Size2f(w / sum, h / sum), angle);
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,84 @@
+#ifndef sonar_processing_DetectionClustering_hpp
+#define sonar_processing_DetectionClustering_hpp
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Non-maximum suppression of rotated detections.
+ * The candidate centers are hashed in a grid with cells as large as the
+ * biggest candidate, so only candidates in neighbour cells are compared.
+ * Overlapping candidates are merged in clusters and each cluster is reduced
+ * to its best candidate, or to the weighted fusion of its members.
+ */
+class DetectionClustering {
+
+public:
+
+    DetectionClustering();
+    ~DetectionClustering();
+
+    /**
+     * Cluster the detections.
+     * @param result_locations: one location per cluster, the best one first
+     * @param result_weights: the best weight of each cluster
+     */
+    void Apply(
+        const std::vector<cv::RotatedRect>& locations,
+        const std::vector<double>& weights,
+        std::vector<cv::RotatedRect>& result_locations,
+        std::vector<double>& result_weights) const;
+
+    // the minimum intersection over union of two candidates in the same cluster
+    void set_overlap_threshold(double overlap_threshold) {
+        overlap_threshold_ = overlap_threshold;
+    }
+
+    double overlap_threshold() const {
+        return overlap_threshold_;
+    }
+
+    // the maximum number of clusters kept, zero means no limit
+    void set_max_results(size_t max_results) {
+        max_results_ = max_results;
+    }
+
+    size_t max_results() const {
+        return max_results_;
+    }
+
+    // replace each cluster by the weighted mean of its members
+    void set_box_fusion_enable(bool box_fusion_enable) {
+        box_fusion_enable_ = box_fusion_enable;
+    }
+
+    bool box_fusion_enable() const {
+        return box_fusion_enable_;
+    }
+
+    /**
+     * The intersection over union of two rotated rectangles.
+     */
+    static double Overlap(const cv::RotatedRect& a, const cv::RotatedRect& b);
+
+private:
+
+    void BuildClusters(
+        const std::vector<cv::RotatedRect>& locations,
+        std::vector<int>& cluster_ids) const;
+
+    cv::RotatedRect FuseCluster(
+        const std::vector<cv::RotatedRect>& locations,
+        const std::vector<double>& weights,
+        const std::vector<int>& members) const;
+
+    double overlap_threshold_;
+    size_t max_results_;
+    bool box_fusion_enable_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_DetectionClustering_hpp */
@@ -0,0 +1,180 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "DetectorModel.hpp"
+
+namespace sonar_processing {
+
+DetectorModel::DetectorModel()
+    : mapped_data_(NULL)
+    , mapped_size_(0)
+{
+}
+
+DetectorModel::~DetectorModel() {
+    Close();
+}
+
+void DetectorModel::Save(
+    const std::string& filename,
+    const cv::HOGDescriptor& hog_descriptor,
+    double training_scale_factor,
+    double detection_scale_factor,
+    double cascade_min_mean_intensity,
+    double cascade_min_intensity_stddev,
+    const std::vector<float>& detector)
+{
+    CV_Assert(sizeof(Header) == kHeaderSize);
+    CV_Assert(detector.size() == hog_descriptor.getDescriptorSize() + 1);
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.window_width = hog_descriptor.winSize.width;
+    header.window_height = hog_descriptor.winSize.height;
+    header.block_width = hog_descriptor.blockSize.width;
+    header.block_height = hog_descriptor.blockSize.height;
+    header.block_stride_width = hog_descriptor.blockStride.width;
+    header.block_stride_height = hog_descriptor.blockStride.height;
+    header.cell_width = hog_descriptor.cellSize.width;
+    header.cell_height = hog_descriptor.cellSize.height;
+    header.nbins = hog_descriptor.nbins;
+    header.var_count = (int32_t)detector.size() - 1;
+    header.training_scale_factor = training_scale_factor;
+    header.detection_scale_factor = detection_scale_factor;
+    header.cascade_min_mean_intensity = cascade_min_mean_intensity;
+    header.cascade_min_intensity_stddev = cascade_min_intensity_stddev;
+
+    FILE* file = fopen(filename.c_str(), "wb");
+
+    if (!file) {
+        throw std::runtime_error("failed to create the detector model file " + filename);
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(&detector[0], sizeof(float), detector.size(), file) == detector.size();
+
+    if (fclose(file) != 0 || !written) {
+        throw std::runtime_error("failed to write the detector model file " + filename);
+    }
+}
+
+bool DetectorModel::IsModelFilename(const std::string& filename) {
+    const std::string extension = ".bin";
+    return filename.size() > extension.size() &&
+           filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+bool DetectorModel::Load(const std::string& filename) {
+    CV_Assert(sizeof(Header) == kHeaderSize);
+
+    Close();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        throw std::runtime_error("failed to open the detector model file " + filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("failed to read the detector model file " + filename);
+    }
+
+    uint32_t magic = 0;
+    if ((size_t)st.st_size < sizeof(Header) ||
+        pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) ||
+        magic != kMagic) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("failed to map the detector model file " + filename);
+    }
+
+    mapped_data_ = data;
+    mapped_size_ = st.st_size;
+
+    if (header().version == 0 || header().version > kVersion) {
+        Close();
+        throw std::runtime_error("unsupported detector model version in " + filename);
+    }
+
+    if (header().var_count <= 0 ||
+        mapped_size_ != sizeof(Header) + (header().var_count + 1) * sizeof(float)) {
+        Close();
+        throw std::runtime_error("corrupted detector model file " + filename);
+    }
+
+    return true;
+}
+
+void DetectorModel::Close() {
+    if (mapped_data_) {
+        munmap(mapped_data_, mapped_size_);
+        mapped_data_ = NULL;
+        mapped_size_ = 0;
+    }
+}
+
+void DetectorModel::Configure(cv::HOGDescriptor& hog_descriptor) const {
+    const Header& h = header();
+    hog_descriptor.winSize = cv::Size(h.window_width, h.window_height);
+    hog_descriptor.blockSize = cv::Size(h.block_width, h.block_height);
+    hog_descriptor.blockStride = cv::Size(h.block_stride_width, h.block_stride_height);
+    hog_descriptor.cellSize = cv::Size(h.cell_width, h.cell_height);
+    hog_descriptor.nbins = h.nbins;
+
+    if (hog_descriptor.getDescriptorSize() != (size_t)h.var_count) {
+        throw std::runtime_error("the detector model does not match its HOG parameters");
+    }
+}
+
+cv::Size DetectorModel::window_size() const {
+    return cv::Size(header().window_width, header().window_height);
+}
+
+double DetectorModel::training_scale_factor() const {
+    return header().training_scale_factor;
+}
+
+double DetectorModel::detection_scale_factor() const {
+    return header().detection_scale_factor;
+}
+
+double DetectorModel::cascade_min_mean_intensity() const {
+    return header().cascade_min_mean_intensity;
+}
+
+double DetectorModel::cascade_min_intensity_stddev() const {
+    return header().cascade_min_intensity_stddev;
+}
+
+const float* DetectorModel::detector_data() const {
+    return reinterpret_cast<const float*>(static_cast<const uint8_t*>(mapped_data_) + sizeof(Header));
+}
+
+size_t DetectorModel::detector_size() const {
+    return header().var_count + 1;
+}
+
+void DetectorModel::detector(std::vector<float>& detector) const {
+    detector.assign(detector_data(), detector_data() + detector_size());
+}
+
+const DetectorModel::Header& DetectorModel::header() const {
+    CV_Assert(mapped_data_);
+    return *static_cast<const Header*>(mapped_data_);
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,115 @@
+#ifndef sonar_processing_DetectorModel_hpp
+#define sonar_processing_DetectorModel_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Binary HOG detector model.
+ * The file holds a fixed size header with the HOG parameters and scale
+ * factors used in the training, followed by the detector weights and bias
+ * as aligned floats. The file is memory mapped when loaded, so no parsing
+ * is needed.
+ */
+class DetectorModel {
+
+public:
+
+    static const uint32_t kMagic = 0x54454448; // "HDET"
+    static const uint32_t kVersion = 2;
+
+    // the weights start on a cache line boundary
+    static const size_t kHeaderSize = 128;
+
+    DetectorModel();
+    ~DetectorModel();
+
+    /**
+     * Write a model file.
+     * @param detector: the weights followed by the bias
+     */
+    static void Save(
+        const std::string& filename,
+        const cv::HOGDescriptor& hog_descriptor,
+        double training_scale_factor,
+        double detection_scale_factor,
+        double cascade_min_mean_intensity,
+        double cascade_min_intensity_stddev,
+        const std::vector<float>& detector);
+
+    /**
+     * Check the file name extension used by the binary models.
+     */
+    static bool IsModelFilename(const std::string& filename);
+
+    /**
+     * Map a model file.
+     * @return false if the file is not a binary model
+     */
+    bool Load(const std::string& filename);
+
+    void Close();
+
+    /**
+     * Apply the model HOG parameters to the descriptor.
+     */
+    void Configure(cv::HOGDescriptor& hog_descriptor) const;
+
+    cv::Size window_size() const;
+
+    double training_scale_factor() const;
+
+    double detection_scale_factor() const;
+
+    double cascade_min_mean_intensity() const;
+
+    double cascade_min_intensity_stddev() const;
+
+    /**
+     * The weights followed by the bias, valid until Close.
+     */
+    const float* detector_data() const;
+
+    size_t detector_size() const;
+
+    void detector(std::vector<float>& detector) const;
+
+private:
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        int32_t window_width;
+        int32_t window_height;
+        int32_t block_width;
+        int32_t block_height;
+        int32_t block_stride_width;
+        int32_t block_stride_height;
+        int32_t cell_width;
+        int32_t cell_height;
+        int32_t nbins;
+        int32_t var_count;
+        double training_scale_factor;
+        double detection_scale_factor;
+        // added in version 2, zero in version 1 files
+        double cascade_min_mean_intensity;
+        double cascade_min_intensity_stddev;
+        uint8_t reserved[48];
+    };
+
+    DetectorModel(const DetectorModel&);
+    DetectorModel& operator=(const DetectorModel&);
+
+    const Header& header() const;
+
+    void* mapped_data_;
+    size_t mapped_size_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_DetectorModel_hpp */
@@ -0,0 +1,90 @@
+#ifndef sonar_processing_FastMath_hpp
+#define sonar_processing_FastMath_hpp
+
+#include <cstring>
+#include <stdint.h>
+
+namespace sonar_processing {
+
+namespace fast_math {
+
+/**
+ * Natural logarithm with the cephes logf polynomial, the relative error is
+ * below 1e-6. The zero and negative values are clamped to the smallest
+ * normalized float. It has no branches, so the loops over image rows can be
+ * vectorized by the compiler.
+ */
+inline float log(float x) {
+    x = (x > 1.17549435e-38f) ? x : 1.17549435e-38f;
+
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    // x = m * 2^e, with m in [0.5, 1)
+    float e = (float)(((bits >> 23) & 0xff) - 126);
+    bits = (bits & 0x007fffff) | 0x3f000000;
+
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+
+    // shift m to [sqrt(0.5), sqrt(2))
+    bool low = m < 0.707106781186547524f;
+    e = low ? e - 1.0f : e;
+    m = low ? m + m - 1.0f : m - 1.0f;
+
+    float z = m * m;
+    float y = 7.0376836292e-2f;
+    y = y * m - 1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m - 1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m - 1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m - 2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y = y * m * z;
+
+    y += -2.12194440e-4f * e;
+    y += -0.5f * z;
+    return m + y + 0.693359375f * e;
+}
+
+/**
+ * Exponential with the cephes expf polynomial, the relative error is below
+ * 1e-6. The input is clamped to the range of normalized floats. It has no
+ * branches, so the loops over image rows can be vectorized by the compiler.
+ */
+inline float exp(float x) {
+    x = (x < 88.0f) ? x : 88.0f;
+    x = (x > -87.33654475f) ? x : -87.33654475f;
+
+    // x = n * log(2) + r, with |r| <= log(2) / 2
+    float fx = x * 1.44269504088896341f + 0.5f;
+    float n = (float)(int32_t)fx;
+    n = (n > fx) ? n - 1.0f : n;
+
+    x -= n * 0.693359375f;
+    x -= n * -2.12194440e-4f;
+
+    float z = x * x;
+    float y = 1.9875691500e-4f;
+    y = y * x + 1.3981999507e-3f;
+    y = y * x + 8.3334519073e-3f;
+    y = y * x + 4.1665795894e-2f;
+    y = y * x + 1.6666665459e-1f;
+    y = y * x + 5.0000001201e-1f;
+    y = y * z + x + 1.0f;
+
+    // 2^n built from its exponent bits
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float pow2n;
+    memcpy(&pow2n, &bits, sizeof(pow2n));
+
+    return y * pow2n;
+}
+
+} /* namespace fast_math */
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_FastMath_hpp */
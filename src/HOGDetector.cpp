@@ -1,4 +1,9 @@
+#include <cfloat>
 #include <cstdio>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include "DetectorModel.hpp"
 #include "HogDescriptorViz.hpp"
 #include "LinearSVM.hpp"
 #include "Preprocessing.hpp"
@@ -7,22 +12,54 @@
 
 namespace sonar_processing {
 
+inline static size_t grid_hash(int cx, int cy, size_t bucket_count) {
+    return (((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u)) % bucket_count;
+}
+
+// the fraction of the rectangle inside the mask, the rectangle is clipped to the image
+inline static double mask_coverage(const cv::Mat& mask_integral, cv::Rect rc) {
+    rc &= cv::Rect(0, 0, mask_integral.cols-1, mask_integral.rows-1);
+    if (rc.area() == 0) return 0;
+    return image_util::integral_image_sum<int>(mask_integral, rc) / (255.0 * rc.area());
+}
+
 HOGDetector::HOGDetector()
 {
     window_size_ = cv::Size(192, 48);
     window_stride_ = cv::Size(8, 8);
     training_scale_factor_ = 0.3;
     detection_scale_factor_ = 0.5;
+    detection_scale_preprocessing_ = false;
     detection_minimum_weight_ = 0;
     show_descriptor_ = false;
     show_positive_window_ = false;
     sonar_image_size_ = cv::Size(-1, -1);
+    sonar_source_size_ = cv::Size(-1, -1);
     image_scale_ = 1.125;
     orientation_step_ = 15.0;
     orientation_range_ = 15.0;
     succeeded_detect_count_ = 0;
     failed_detect_count_ = 0;
+    batch_chunk_size_ = 64;
+    training_matrix_filename_ = "";
+    hard_negative_mining_rounds_ = 0;
+    initial_negative_fraction_ = 0.1;
+    hard_negative_margin_ = 0.0;
+    max_negative_count_ = 0;
+    svm_trainer_type_ = kLinearSVMTrainer;
+    proposal_enable_ = false;
+    proposal_intensity_ratio_ = 1.0;
+    cascade_enable_ = false;
+    cascade_target_recall_ = 0.99;
+    cascade_min_mean_intensity_ = 0;
+    cascade_min_intensity_stddev_ = 0;
+    integer_hog_enable_ = false;
     memset(&last_detected_location_, 0, sizeof(last_detected_location_));
+    next_track_id_ = 0;
+    frame_count_ = 0;
+    full_sweep_interval_ = 50;
+    max_track_misses_ = 5;
+    track_gate_distance_ = 50.0;
 }
 
 HOGDetector::~HOGDetector() {
@@ -37,34 +74,204 @@ void HOGDetector::Train(
     // set hog window size
     hog_descriptor_.winSize = window_size_;
 
-    //load training data
-    std::vector<cv::Mat> gradient_positive;
-    std::vector<cv::Mat> gradient_negative;
-    LoadTrainingData(training_samples, training_annotations, gradient_positive, gradient_negative);
+    // the descriptors are streamed to a matrix file instead of being kept in memory
+    std::string matrix_filename = training_matrix_filename_;
+    if (matrix_filename.empty()) {
+        matrix_filename = training_filename + ".descriptors";
+    }
 
-    // prepare training data
-    std::vector<int> labels;
-    cv::Mat training_data;
-    PrepareTrainingData(gradient_positive, gradient_negative, labels, training_data);
+    DescriptorMatrix training_data;
+    training_data.Create(matrix_filename, (int)hog_descriptor_.getDescriptorSize());
+
+    // with hard negative mining, the first model is trained with a random
+    // subset of the negative windows
+    double negative_fraction = (hard_negative_mining_rounds_ > 0) ? initial_negative_fraction_ : 1.0;
+
+    //load training data
+    std::vector<float> positive_stats;
+    LoadTrainingData(training_samples, training_annotations, negative_fraction, training_data, positive_stats);
+    LearnCascadeThresholds(positive_stats);
 
     if (show_positive_window_) {
         cv::destroyWindow("positive_input_image");
     }
 
+    std::vector<float> hog_detector;
+
+    for (int round = 0; round < hard_negative_mining_rounds_; round++) {
+        SVMTrain(training_data, "", hog_detector);
+        SetSVMDetector(hog_detector);
+
+        size_t total_mined = MineHardNegatives(training_samples, training_annotations, training_data);
+        std::cout << "Hard negative mining round " << (round+1) << ": " << total_mined << " false positives" << std::endl;
+
+        if (total_mined == 0) {
+            break;
+        }
+    }
+
     // training using the hog descriptor
-    SVMTrain(labels, training_data, training_filename);
+    SVMTrain(training_data, training_filename, hog_detector);
+    SetSVMDetector(hog_detector);
+
+    training_data.Remove();
 }
 
 void HOGDetector::LoadSVMTrain(const std::string& svm_model_filename)
 {
-    LinearSVM svm;
-    svm.load(svm_model_filename.c_str());
-
     std::vector<float> hog_detector;
-    svm.get_detector(hog_detector);
+
+    // the binary model carries its own HOG parameters
+    DetectorModel model;
+    if (model.Load(svm_model_filename)) {
+        model.Configure(hog_descriptor_);
+        window_size_ = model.window_size();
+        training_scale_factor_ = model.training_scale_factor();
+        detection_scale_factor_ = model.detection_scale_factor();
+        cascade_min_mean_intensity_ = model.cascade_min_mean_intensity();
+        cascade_min_intensity_stddev_ = model.cascade_min_intensity_stddev();
+        model.detector(hog_detector);
+        SetSVMDetector(hog_detector);
+        return;
+    }
+
+    cv::FileStorage fs(svm_model_filename, cv::FileStorage::READ);
+    cv::FileNode node = (fs.isOpened()) ? fs["hog_detector"] : cv::FileNode();
+
+    if (!node.empty()) {
+        node >> hog_detector;
+        fs["cascade_min_mean_intensity"] >> cascade_min_mean_intensity_;
+        fs["cascade_min_intensity_stddev"] >> cascade_min_intensity_stddev_;
+    }
+    else {
+        // the thresholds of a previous model must not be applied to this one
+        cascade_min_mean_intensity_ = 0;
+        cascade_min_intensity_stddev_ = 0;
+
+        LinearSVM svm;
+        svm.load(svm_model_filename.c_str());
+        svm.get_detector(hog_detector);
+
+        // the epsilon-SVR models store the thresholds after the model node
+        if (fs.isOpened()) {
+            fs["cascade_min_mean_intensity"] >> cascade_min_mean_intensity_;
+            fs["cascade_min_intensity_stddev"] >> cascade_min_intensity_stddev_;
+        }
+    }
 
     hog_descriptor_.winSize = window_size_;
+    SetSVMDetector(hog_detector);
+}
+
+void HOGDetector::SetSVMDetector(const std::vector<float>& hog_detector)
+{
     hog_descriptor_.setSVMDetector(hog_detector);
+
+    // the fixed point detector needs 2x2 cell blocks with one cell stride, an
+    // unsupported detector must not leave the previous quantized one behind
+    if (IntegerHOG::IsSupported(hog_descriptor_)) {
+        integer_hog_.SetDetector(hog_descriptor_, hog_detector);
+    }
+    else {
+        integer_hog_.Release();
+    }
+}
+
+HOGDetector::IntegerHOGEvaluation HOGDetector::EvaluateIntegerHOG(
+    const std::vector<base::samples::Sonar>& samples)
+{
+    CV_Assert(!integer_hog_.empty());
+
+    IntegerHOGEvaluation evaluation;
+    evaluation.window_count = 0;
+    evaluation.float_hit_count = 0;
+    evaluation.integer_hit_count = 0;
+    evaluation.common_hit_count = 0;
+    evaluation.mean_score_error = 0;
+    evaluation.max_score_error = 0;
+    evaluation.float_time = 0;
+    evaluation.integer_time = 0;
+
+    SonarHolder sonar_holder;
+    cv::Mat scaled_image;
+    cv::Mat scaled_mask;
+
+    std::vector<cv::Point> float_points;
+    std::vector<double> float_weights;
+    std::vector<cv::Point> integer_points;
+    std::vector<double> integer_weights;
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        const base::samples::Sonar& sample = samples[i];
+
+        sonar_holder.Reset(
+            sample.bins,
+            utils::get_radians(sample.bearings),
+            sample.beam_width.getRad(),
+            sample.bin_count,
+            sample.beam_count,
+            sonar_image_size_);
+
+        Preprocess(sonar_holder.cart_image(), sonar_holder.cart_image_mask(), scaled_image, scaled_mask);
+
+        // the same input used by PerformDetect without rotation
+        cv::Mat input_image;
+        scaled_image(image_util::get_bounding_rect(scaled_mask)).convertTo(input_image, CV_8U, 255.0);
+
+        if (window_size_.width >= input_image.cols || window_size_.height >= input_image.rows) {
+            continue;
+        }
+
+        // every window is scored by both detectors
+        uint64_t t0 = utils::now::microseconds();
+        hog_descriptor_.detect(input_image, float_points, float_weights, -DBL_MAX, window_stride_, cv::Size(0, 0));
+        uint64_t t1 = utils::now::microseconds();
+        integer_hog_.Detect(input_image, integer_points, integer_weights, -DBL_MAX, window_stride_);
+        uint64_t t2 = utils::now::microseconds();
+
+        evaluation.float_time += (t1 - t0) / 1000000.0;
+        evaluation.integer_time += (t2 - t1) / 1000000.0;
+
+        std::map<std::pair<int, int>, double> float_scores;
+        for (size_t k = 0; k < float_points.size(); k++) {
+            float_scores[std::make_pair(float_points[k].x, float_points[k].y)] = float_weights[k];
+        }
+
+        for (size_t k = 0; k < integer_points.size(); k++) {
+            std::map<std::pair<int, int>, double>::const_iterator it =
+                float_scores.find(std::make_pair(integer_points[k].x, integer_points[k].y));
+
+            if (it == float_scores.end()) {
+                continue;
+            }
+
+            double float_score = it->second;
+            double integer_score = integer_weights[k];
+            double error = fabs(float_score - integer_score);
+
+            evaluation.window_count++;
+            evaluation.mean_score_error += error;
+            evaluation.max_score_error = std::max(evaluation.max_score_error, error);
+
+            if (float_score >= 0) evaluation.float_hit_count++;
+            if (integer_score >= 0) evaluation.integer_hit_count++;
+            if (float_score >= 0 && integer_score >= 0) evaluation.common_hit_count++;
+        }
+    }
+
+    if (evaluation.window_count > 0) {
+        evaluation.mean_score_error /= evaluation.window_count;
+    }
+
+    std::cout << "Integer HOG evaluation windows: " << evaluation.window_count << std::endl;
+    std::cout << "Float hits: " << evaluation.float_hit_count << std::endl;
+    std::cout << "Integer hits: " << evaluation.integer_hit_count << std::endl;
+    std::cout << "Common hits: " << evaluation.common_hit_count << std::endl;
+    std::cout << "Mean score error: " << evaluation.mean_score_error << std::endl;
+    std::cout << "Max score error: " << evaluation.max_score_error << std::endl;
+    std::cout << "Float time: " << evaluation.float_time << "s, integer time: " << evaluation.integer_time << "s" << std::endl;
+
+    return evaluation;
 }
 
 bool HOGDetector::Detect(
@@ -100,13 +307,12 @@ bool HOGDetector::Detect(
     std::vector<cv::RotatedRect>& locations,
     std::vector<double>& found_weights)
 {
-    sonar_source_image.copyTo(sonar_source_image_);
-    sonar_source_mask.copyTo(sonar_source_mask_);
+    sonar_source_size_ = sonar_source_image.size();
 
     // perform preprocessing
     cv::Mat preprocessed_image;
     cv::Mat preprocessed_mask;
-    PerformPreprocessing(preprocessed_image, preprocessed_mask);
+    PerformPreprocessing(sonar_source_image, sonar_source_mask, preprocessed_image, preprocessed_mask);
 
     double rotated_angle;
     cv::Mat input_image;
@@ -133,27 +339,57 @@ bool HOGDetector::Detect(
     std::vector<cv::RotatedRect>& locations,
     std::vector<double>& found_weights)
 {
+    // the inputs are only read, so they are not copied
+    cv::Mat scaled_image;
+    cv::Mat scaled_mask;
+    Preprocess(sonar_source_image, sonar_source_mask, scaled_image, scaled_mask);
 
-    const int SUCCEDED_LIMIT = 5;
-    const int FAILED_LIMIT = 5;
-    const float MIN_LOCATION_DISTANCE = 50.0f;
-    const float PARTIAL_ROTATE_STEP = 5;
-    const float COMPLETE_START_RANGE_ANGLE = -90;
-    const float COMPLETE_FINAL_RANGE_ANGLE = 90;
+    return DetectPreprocessed(
+        scaled_image,
+        scaled_mask,
+        sonar_source_image.size(),
+        locations,
+        found_weights);
+}
 
-    sonar_source_image.copyTo(sonar_source_image_);
-    sonar_source_mask.copyTo(sonar_source_mask_);
+void HOGDetector::Preprocess(
+    const cv::Mat& sonar_source_image,
+    const cv::Mat& sonar_source_mask,
+    cv::Mat& scaled_image,
+    cv::Mat& scaled_mask) const
+{
+    if (detection_scale_preprocessing_) {
+        sonar_image_processing_.ApplyScaled(
+            sonar_source_image,
+            sonar_source_mask,
+            scaled_image,
+            scaled_mask,
+            detection_scale_factor_);
+        return;
+    }
 
-    // perform preprocessing
     cv::Mat preprocessed_image;
     cv::Mat preprocessed_mask;
-    PerformPreprocessing(preprocessed_image, preprocessed_mask);
+    PerformPreprocessing(sonar_source_image, sonar_source_mask, preprocessed_image, preprocessed_mask);
 
-    cv::Mat scaled_image;
     cv::resize(preprocessed_image, scaled_image, cv::Size(), detection_scale_factor_, detection_scale_factor_);
-
-    cv::Mat scaled_mask;
     cv::resize(preprocessed_mask, scaled_mask, cv::Size(), detection_scale_factor_, detection_scale_factor_);
+}
+
+bool HOGDetector::DetectPreprocessed(
+    const cv::Mat& scaled_image,
+    const cv::Mat& scaled_mask,
+    cv::Size sonar_source_size,
+    std::vector<cv::RotatedRect>& locations,
+    std::vector<double>& found_weights)
+{
+    const int SUCCEDED_LIMIT = 5;
+    const int FAILED_LIMIT = 5;
+    const float MIN_LOCATION_DISTANCE = 50.0f;
+    const float COMPLETE_START_RANGE_ANGLE = -90;
+    const float COMPLETE_FINAL_RANGE_ANGLE = 90;
+
+    sonar_source_size_ = sonar_source_size;
 
     if (failed_detect_count_ > FAILED_LIMIT) {
         succeeded_detect_count_ = 0;
@@ -173,6 +409,8 @@ bool HOGDetector::Detect(
             locations,
             found_weights);
 
+        detection_clustering_.Apply(locations, found_weights, locations, found_weights);
+
         if (locations.empty()) {
             succeeded_detect_count_ = 0;
             return false;
@@ -201,6 +439,14 @@ bool HOGDetector::Detect(
             }
         }
 
+        if (succeeded_detect_count_ == 0) {
+            tracking_filter_.Reset(best_detected_location);
+        }
+        else {
+            tracking_filter_.Predict();
+            tracking_filter_.Correct(best_detected_location);
+        }
+
         last_detected_location_ = best_detected_location;
 
         succeeded_detect_count_++;
@@ -208,7 +454,203 @@ bool HOGDetector::Detect(
         return true;
     }
 
-    cv::Rect bbox = GetLastDetectedBoundingRect(
+    cv::RotatedRect predicted_location = tracking_filter_.Predict();
+
+    // a complete orientation sweep is done periodically
+    SearchTrackedLocation(
+        scaled_image,
+        scaled_mask,
+        tracking_filter_,
+        predicted_location,
+        succeeded_detect_count_ % 50 == 0,
+        locations,
+        found_weights);
+
+    if (locations.empty()) {
+        failed_detect_count_++;
+        return false;
+    }
+
+    double best_weight = -1;
+    FindBestDetectionLocation(locations, found_weights, best_weight, last_detected_location_);
+    tracking_filter_.Correct(last_detected_location_);
+
+    succeeded_detect_count_++;
+    failed_detect_count_ = 0;
+
+    return true;
+}
+
+// the sample has the polar geometry the cartesian tables of the holder were built for
+static bool same_sonar_geometry(const base::samples::Sonar& sample, const SonarHolder& geometry) {
+    if (sample.bin_count != geometry.bin_count() ||
+        sample.beam_count != geometry.beam_count() ||
+        (float)sample.beam_width.getRad() != geometry.beam_width() ||
+        sample.bearings.size() != geometry.bearings().size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sample.bearings.size(); i++) {
+        if ((float)sample.bearings[i].rad != geometry.bearings()[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+class BatchPreprocessing : public cv::ParallelLoopBody
+{
+
+public:
+
+    BatchPreprocessing(
+        const HOGDetector& detector,
+        const SonarHolder& geometry,
+        std::vector<base::samples::Sonar>::const_iterator first,
+        std::vector<cv::Mat>& scaled_images,
+        std::vector<cv::Mat>& scaled_masks,
+        std::vector<cv::Size>& source_sizes)
+        : detector_(detector)
+        , geometry_(geometry)
+        , first_(first)
+        , scaled_images_(scaled_images)
+        , scaled_masks_(scaled_masks)
+        , source_sizes_(source_sizes)
+    {
+    }
+
+    void operator()(const cv::Range& range) const {
+        // scratch buffers owned by this worker
+        SonarHolder sonar_holder;
+        cv::Mat cart_image;
+
+        for (int k = range.start; k < range.end; k++) {
+            const base::samples::Sonar& sample = *(first_ + k);
+
+            if (same_sonar_geometry(sample, geometry_)) {
+                // the geometry tables are shared between the workers
+                geometry_.CreateCartesianImage(sample.bins, cart_image);
+
+                detector_.Preprocess(
+                    cart_image,
+                    geometry_.cart_image_mask(),
+                    scaled_images_[k],
+                    scaled_masks_[k]);
+
+                source_sizes_[k] = cart_image.size();
+            }
+            else {
+                sonar_holder.Reset(
+                    sample.bins,
+                    utils::get_radians(sample.bearings),
+                    sample.beam_width.getRad(),
+                    sample.bin_count,
+                    sample.beam_count,
+                    detector_.sonar_image_size());
+
+                detector_.Preprocess(
+                    sonar_holder.cart_image(),
+                    sonar_holder.cart_image_mask(),
+                    scaled_images_[k],
+                    scaled_masks_[k]);
+
+                source_sizes_[k] = sonar_holder.cart_image().size();
+            }
+        }
+    }
+
+private:
+    const HOGDetector& detector_;
+    const SonarHolder& geometry_;
+    std::vector<base::samples::Sonar>::const_iterator first_;
+    std::vector<cv::Mat>& scaled_images_;
+    std::vector<cv::Mat>& scaled_masks_;
+    std::vector<cv::Size>& source_sizes_;
+};
+
+void HOGDetector::DetectBatch(
+    std::vector<base::samples::Sonar>::const_iterator first,
+    std::vector<base::samples::Sonar>::const_iterator last,
+    std::vector<std::vector<cv::RotatedRect> >& locations,
+    std::vector<std::vector<double> >& found_weights,
+    std::vector<uchar>& detected)
+{
+    const size_t total = std::distance(first, last);
+
+    locations.assign(total, std::vector<cv::RotatedRect>());
+    found_weights.assign(total, std::vector<double>());
+    detected.assign(total, 0);
+
+    if (total == 0) {
+        return;
+    }
+
+    // the geometry is initialized from the first sample and reused by
+    // every sample with the same bins, bearings and beam width
+    const base::samples::Sonar& reference = *first;
+    sonar_holder_.Reset(
+        reference.bins,
+        utils::get_radians(reference.bearings),
+        reference.beam_width.getRad(),
+        reference.bin_count,
+        reference.beam_count,
+        sonar_image_size_);
+
+    const size_t chunk_size = std::max<size_t>(batch_chunk_size_, 1);
+
+    std::vector<cv::Mat> scaled_images;
+    std::vector<cv::Mat> scaled_masks;
+    std::vector<cv::Size> source_sizes;
+
+    for (size_t offset = 0; offset < total; offset += chunk_size) {
+        const size_t count = std::min(chunk_size, total - offset);
+
+        scaled_images.assign(count, cv::Mat());
+        scaled_masks.assign(count, cv::Mat());
+        source_sizes.assign(count, cv::Size());
+
+        // the preprocessing does not depend on the tracking state
+        cv::parallel_for_(
+            cv::Range(0, (int)count),
+            BatchPreprocessing(*this, sonar_holder_, first + offset,
+                scaled_images, scaled_masks, source_sizes));
+
+        // the detection runs in the sample order, so the tracking state
+        // evolves exactly as in a sequential run
+        for (size_t k = 0; k < count; k++) {
+            detected[offset + k] = DetectPreprocessed(
+                scaled_images[k],
+                scaled_masks[k],
+                source_sizes[k],
+                locations[offset + k],
+                found_weights[offset + k]);
+        }
+    }
+}
+
+void HOGDetector::SearchTrackedLocation(
+    const cv::Mat& scaled_image,
+    const cv::Mat& scaled_mask,
+    const TrackingFilter& filter,
+    const cv::RotatedRect& predicted_location,
+    bool complete_sweep,
+    std::vector<cv::RotatedRect>& locations,
+    std::vector<double>& found_weights)
+{
+    const float PARTIAL_ROTATE_STEP = 5;
+    const float COMPLETE_START_RANGE_ANGLE = -90;
+    const float COMPLETE_FINAL_RANGE_ANGLE = 90;
+    const double TRACKING_SIGMA_COUNT = 3.0;
+
+    // the search region grows with the uncertainty of the predicted location
+    double position_margin = TRACKING_SIGMA_COUNT * filter.position_stddev();
+    double angle_range = TRACKING_SIGMA_COUNT * filter.angle_stddev();
+    angle_range = std::min(std::max(angle_range, (double)PARTIAL_ROTATE_STEP), orientation_range_);
+
+    cv::Rect bbox = GetTrackingBoundingRect(
+        predicted_location,
+        position_margin,
         detection_scale_factor_,
         scaled_mask.size());
 
@@ -218,13 +660,13 @@ bool HOGDetector::Detect(
     float start_angle;
     float final_angle;
 
-    if (succeeded_detect_count_ % 50 == 0) {
+    if (complete_sweep) {
         start_angle = COMPLETE_START_RANGE_ANGLE;
         final_angle = COMPLETE_FINAL_RANGE_ANGLE;
     }
     else {
-        start_angle = last_detected_location_.angle-orientation_range_;
-        final_angle = last_detected_location_.angle+orientation_range_;
+        start_angle = predicted_location.angle-angle_range;
+        final_angle = predicted_location.angle+angle_range;
     }
 
     RotateAndDetect(
@@ -236,19 +678,225 @@ bool HOGDetector::Detect(
         locations,
         found_weights);
 
+    detection_clustering_.Apply(locations, found_weights, locations, found_weights);
+}
 
-    if (locations.empty()) {
-        failed_detect_count_++;
-        return false;
+bool HOGDetector::DetectTargets(
+    const cv::Mat& sonar_source_image,
+    const cv::Mat& sonar_source_mask,
+    std::vector<Track>& tracks)
+{
+    cv::Mat scaled_image;
+    cv::Mat scaled_mask;
+    Preprocess(sonar_source_image, sonar_source_mask, scaled_image, scaled_mask);
+
+    return DetectTargetsPreprocessed(
+        scaled_image,
+        scaled_mask,
+        sonar_source_image.size(),
+        tracks);
+}
+
+bool HOGDetector::DetectTargetsPreprocessed(
+    const cv::Mat& scaled_image,
+    const cv::Mat& scaled_mask,
+    cv::Size sonar_source_size,
+    std::vector<Track>& tracks)
+{
+    const float COMPLETE_START_RANGE_ANGLE = -90;
+    const float COMPLETE_FINAL_RANGE_ANGLE = 90;
+
+    sonar_source_size_ = sonar_source_size;
+
+    // the complete sweep looks for new targets
+    bool complete_sweep = tracks_.empty() ||
+        (full_sweep_interval_ > 0 && frame_count_ % full_sweep_interval_ == 0);
+
+    frame_count_++;
+
+    std::vector<cv::RotatedRect> predicted_locations(tracks_.size());
+    for (size_t i = 0; i < tracks_.size(); i++) {
+        predicted_locations[i] = tracks_[i].filter.Predict();
     }
 
-    double best_weight = -1;
-    FindBestDetectionLocation(locations, found_weights, best_weight, last_detected_location_);
+    std::vector<uchar> updated(tracks_.size(), 0);
+    bool detected = false;
 
-    succeeded_detect_count_++;
-    failed_detect_count_ = 0;
+    std::vector<cv::RotatedRect> locations;
+    std::vector<double> weights;
 
-    return true;
+    if (complete_sweep) {
+        RotateAndDetect(
+            scaled_image,
+            scaled_mask,
+            COMPLETE_START_RANGE_ANGLE,
+            COMPLETE_FINAL_RANGE_ANGLE,
+            orientation_step_,
+            locations,
+            weights);
+
+        detection_clustering_.Apply(locations, weights, locations, weights);
+
+        std::vector<int> assigned_tracks;
+        AssociateDetections(predicted_locations, locations, assigned_tracks);
+
+        for (size_t k = 0; k < locations.size(); k++) {
+            if (weights[k] < detection_minimum_weight_) {
+                continue;
+            }
+
+            detected = true;
+
+            int i = assigned_tracks[k];
+
+            if (i >= 0) {
+                UpdateTrack(tracks_[i], locations[k], weights[k]);
+                updated[i] = 1;
+            }
+            else {
+                TrackState state;
+                state.track.id = next_track_id_++;
+                state.track.location = locations[k];
+                state.track.weight = weights[k];
+                state.track.hit_count = 1;
+                state.track.miss_count = 0;
+                state.filter = tracking_filter_;
+                state.filter.Reset(locations[k]);
+                tracks_.push_back(state);
+                updated.push_back(1);
+            }
+        }
+    }
+    else {
+        // each track is searched in its own region and angle range
+        for (size_t i = 0; i < predicted_locations.size(); i++) {
+            locations.clear();
+            weights.clear();
+
+            SearchTrackedLocation(
+                scaled_image,
+                scaled_mask,
+                tracks_[i].filter,
+                predicted_locations[i],
+                false,
+                locations,
+                weights);
+
+            if (locations.empty()) {
+                continue;
+            }
+
+            double best_weight = -1;
+            cv::RotatedRect best_location;
+            FindBestDetectionLocation(locations, weights, best_weight, best_location);
+
+            if (best_weight >= detection_minimum_weight_) {
+                UpdateTrack(tracks_[i], best_location, best_weight);
+                updated[i] = 1;
+                detected = true;
+            }
+        }
+    }
+
+    // drop the lost tracks and the tracks that merged with an older one
+    std::vector<TrackState> live_tracks;
+    for (size_t i = 0; i < tracks_.size(); i++) {
+        if (!updated[i] && ++tracks_[i].track.miss_count > max_track_misses_) {
+            continue;
+        }
+
+        bool duplicated = false;
+        for (size_t j = 0; j < live_tracks.size() && !duplicated; j++) {
+            duplicated = DetectionClustering::Overlap(live_tracks[j].track.location, tracks_[i].track.location) >=
+                         detection_clustering_.overlap_threshold();
+        }
+
+        if (!duplicated) {
+            live_tracks.push_back(tracks_[i]);
+        }
+    }
+    tracks_.swap(live_tracks);
+
+    tracks.resize(tracks_.size());
+    for (size_t i = 0; i < tracks_.size(); i++) {
+        tracks[i] = tracks_[i].track;
+    }
+
+    return detected;
+}
+
+void HOGDetector::UpdateTrack(
+    TrackState& state,
+    const cv::RotatedRect& location,
+    double weight)
+{
+    state.filter.Correct(location);
+    state.track.location = location;
+    state.track.weight = weight;
+    state.track.hit_count++;
+    state.track.miss_count = 0;
+}
+
+void HOGDetector::AssociateDetections(
+    const std::vector<cv::RotatedRect>& predicted_locations,
+    const std::vector<cv::RotatedRect>& locations,
+    std::vector<int>& assigned_tracks) const
+{
+    assigned_tracks.assign(locations.size(), -1);
+
+    if (predicted_locations.empty()) {
+        return;
+    }
+
+    // the predicted centers are hashed in a grid with the gate distance as cell size
+    const double cell_size = std::max(track_gate_distance_, 1.0);
+    const size_t bucket_count = 2 * predicted_locations.size() + 1;
+    std::vector<std::vector<int> > buckets(bucket_count);
+
+    for (size_t i = 0; i < predicted_locations.size(); i++) {
+        int cx = (int)floor(predicted_locations[i].center.x / cell_size);
+        int cy = (int)floor(predicted_locations[i].center.y / cell_size);
+        buckets[grid_hash(cx, cy, bucket_count)].push_back((int)i);
+    }
+
+    std::vector<uchar> taken(predicted_locations.size(), 0);
+    const double max_distance = track_gate_distance_ * track_gate_distance_;
+
+    // the detections are ranked, so the best ones pick their tracks first
+    for (size_t k = 0; k < locations.size(); k++) {
+        int cx = (int)floor(locations[k].center.x / cell_size);
+        int cy = (int)floor(locations[k].center.y / cell_size);
+
+        int best_track = -1;
+        double best_distance = max_distance;
+
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                const std::vector<int>& bucket = buckets[grid_hash(cx + dx, cy + dy, bucket_count)];
+
+                for (size_t n = 0; n < bucket.size(); n++) {
+                    int i = bucket[n];
+
+                    if (taken[i]) {
+                        continue;
+                    }
+
+                    cv::Point2f d = locations[k].center - predicted_locations[i].center;
+                    double distance = d.x * d.x + d.y * d.y;
+
+                    if (distance <= best_distance) {
+                        best_distance = distance;
+                        best_track = i;
+                    }
+                }
+            }
+        }
+
+        if (best_track >= 0) {
+            taken[best_track] = 1;
+            assigned_tracks[k] = best_track;
+        }
+    }
 }
 
 void HOGDetector::RotateAndDetect(
@@ -275,18 +923,146 @@ void HOGDetector::RotateAndDetect(
     }
 }
 
+void HOGDetector::DetectProposals(
+    const cv::Mat& input_image,
+    const cv::Mat& input_mask,
+    const cv::Mat& mask_integral,
+    std::vector<cv::Rect>& locations,
+    std::vector<double>& weights)
+{
+    const int FINAL_THRESHOLD = 2;
+    const double GROUP_EPS = 0.2;
+
+    locations.clear();
+    weights.clear();
+
+    double min_mean_intensity = 0;
+    double min_intensity_stddev = 0;
+
+    if (proposal_enable_) {
+        min_mean_intensity = cv::mean(input_image, input_mask)[0] * proposal_intensity_ratio_;
+    }
+
+    if (cascade_enable_) {
+        min_mean_intensity = std::max(min_mean_intensity, cascade_min_mean_intensity_);
+        min_intensity_stddev = cascade_min_intensity_stddev_;
+    }
+
+    cv::Mat level_image;
+    std::vector<cv::Point> proposals;
+    std::vector<cv::Point> hits;
+    std::vector<double> hit_weights;
+
+    // the same image pyramid used by detectMultiScale
+    for (double scale = 1.0;
+         cvRound(input_image.cols/scale) >= window_size_.width &&
+         cvRound(input_image.rows/scale) >= window_size_.height;
+         scale *= image_scale_) {
+
+        cv::Size level_size(cvRound(input_image.cols/scale), cvRound(input_image.rows/scale));
+
+        if (scale == 1.0) {
+            level_image = input_image;
+        }
+        else {
+            cv::resize(input_image, level_image, level_size);
+        }
+
+        ComputeProposals(level_image, mask_integral, scale, min_mean_intensity, min_intensity_stddev, proposals);
+
+        if (!proposals.empty()) {
+            if (integer_hog_enable_ && !integer_hog_.empty()) {
+                integer_hog_.Detect(level_image, hits, hit_weights, 0.0, window_stride_, proposals);
+            }
+            else {
+                hog_descriptor_.detect(level_image, hits, hit_weights, 0.0, window_stride_, cv::Size(0, 0), proposals);
+            }
+
+            for (size_t i = 0; i < hits.size(); i++) {
+                locations.push_back(cv::Rect(
+                    cvRound(hits[i].x*scale),
+                    cvRound(hits[i].y*scale),
+                    cvRound(window_size_.width*scale),
+                    cvRound(window_size_.height*scale)));
+                weights.push_back(hit_weights[i]);
+            }
+        }
+
+        if (image_scale_ <= 1.0) {
+            break;
+        }
+    }
+
+    // the grouped locations keep the best weight of their group
+    std::vector<int> reject_levels(locations.size(), 0);
+    cv::groupRectangles(locations, reject_levels, weights, FINAL_THRESHOLD, GROUP_EPS);
+}
+
+void HOGDetector::ComputeProposals(
+    const cv::Mat& image,
+    const cv::Mat& mask_integral,
+    double scale,
+    double min_mean_intensity,
+    double min_intensity_stddev,
+    std::vector<cv::Point>& proposals) const
+{
+    const double MIN_MASK_COVERAGE = 0.75;
+
+    proposals.clear();
+
+    if (image.cols < window_size_.width || image.rows < window_size_.height) {
+        return;
+    }
+
+    cv::Mat image_integral;
+    cv::Mat image_sq_integral;
+    cv::integral(image, image_integral, image_sq_integral, CV_32S);
+
+    const cv::Size scaled_window_size(cvRound(window_size_.width*scale), cvRound(window_size_.height*scale));
+
+    const double min_variance = min_intensity_stddev * min_intensity_stddev;
+
+    const double area = window_size_.area();
+
+    // the windows over the water column or outside of the mask are skipped
+    for (int y = 0; y <= image.rows-window_size_.height; y+=window_stride_.height) {
+        for (int x = 0; x <= image.cols-window_size_.width; x+=window_stride_.width) {
+            cv::Rect rc = cv::Rect(cv::Point(x, y), window_size_);
+
+            // the mask integral image is at the pyramid base
+            cv::Rect scaled_rc = cv::Rect(cv::Point(cvRound(x*scale), cvRound(y*scale)), scaled_window_size);
+            if (mask_coverage(mask_integral, scaled_rc) <= MIN_MASK_COVERAGE) {
+                continue;
+            }
+
+            // the cascade stages, cheapest first
+            double mean_intensity = image_util::integral_image_sum<int>(image_integral, rc) / area;
+            if (mean_intensity < min_mean_intensity) {
+                continue;
+            }
+
+            if (min_variance > 0) {
+                double variance = image_util::integral_image_sum<double>(image_sq_integral, rc) / area -
+                                  mean_intensity * mean_intensity;
+                if (variance < min_variance) {
+                    continue;
+                }
+            }
+
+            proposals.push_back(rc.tl());
+        }
+    }
+}
+
 void HOGDetector::FindBestDetectionLocation(
     const std::vector<cv::RotatedRect>& locations,
     const std::vector<double>& weights,
     double& best_weight,
     cv::RotatedRect &best_location)
 {
-    std::vector<size_t> indices(weights.size());
-    for (size_t i = 0; i < indices.size(); i++) indices[i]=i;
-    std::sort(indices.begin(), indices.end(), sonar_processing::utils::IndexComparator<double>(weights));
-    std::reverse(indices.begin(), indices.end());
-    best_weight = weights[indices[0]];
-    best_location = locations[indices[0]];
+    size_t best_index = utils::find_best_weight_location_index(weights);
+    best_weight = weights[best_index];
+    best_location = locations[best_index];
 }
 
 bool HOGDetector::PerformDetect(
@@ -319,23 +1095,33 @@ bool HOGDetector::PerformDetect(
     // convert to unsigned char
     input_image.convertTo(input_image, CV_8U, 255.0);
 
+    // the mask coverage of every window is read from a single integral image
+    cv::Mat mask_integral;
+    cv::integral(input_mask, mask_integral, CV_32S);
+
     std::vector<cv::Rect> locations_rects;
     std::vector<double> weights;
-    hog_descriptor_.detectMultiScale(
-        input_image, // the input image
-        locations_rects, // the found locations rect
-        weights, // the found weights
-        0.0, // the hit-threshold
-        window_stride_, // the window stride
-        cv::Size(8, 8), // the padding
-        //
-        // 1.125, // the image scale
-        image_scale_, // the image scale
-        // 2, // the final threshold
-        2, // the final threshold
-        false); // enable the mean shift grouping
-
-    FilterLocationInsideMask(locations_rects, weights, locations_rects, weights, input_image, input_mask);
+
+    if (proposal_enable_ || cascade_enable_ || (integer_hog_enable_ && !integer_hog_.empty())) {
+        DetectProposals(input_image, input_mask, mask_integral, locations_rects, weights);
+    }
+    else {
+        hog_descriptor_.detectMultiScale(
+            input_image, // the input image
+            locations_rects, // the found locations rect
+            weights, // the found weights
+            0.0, // the hit-threshold
+            window_stride_, // the window stride
+            cv::Size(8, 8), // the padding
+            //
+            // 1.125, // the image scale
+            image_scale_, // the image scale
+            // 2, // the final threshold
+            2, // the final threshold
+            false); // enable the mean shift grouping
+    }
+
+    FilterLocationInsideMask(locations_rects, weights, locations_rects, weights, mask_integral);
 
     if (locations_rects.empty()){
         return false;
@@ -353,55 +1139,314 @@ bool HOGDetector::PerformDetect(
 }
 
 
+class TrainingProgress
+{
+
+public:
+
+    TrainingProgress(size_t total)
+        : done_(0)
+        , total_(total)
+    {
+    }
+
+    void Increment() {
+        cv::AutoLock lock(mutex_);
+        done_++;
+        std::cout << "\rExtracting HOG from samples: " << done_ << " of " << total_ << std::flush;
+    }
+
+private:
+    cv::Mutex mutex_;
+    size_t done_;
+    size_t total_;
+};
+
+class TrainingDataExtraction : public cv::ParallelLoopBody
+{
+
+public:
+
+    TrainingDataExtraction(
+        const HOGDetector& detector,
+        const std::vector<base::samples::Sonar>& training_samples,
+        const std::vector<std::vector<cv::Point> >& training_annotations,
+        size_t offset,
+        std::vector<std::vector<float> >& gradient_positive,
+        std::vector<std::vector<float> >& gradient_negative,
+        std::vector<std::vector<float> >& positive_stats,
+        TrainingProgress& progress,
+        double negative_fraction = 1.0,
+        bool hard_negative_mining = false)
+        : detector_(detector)
+        , training_samples_(training_samples)
+        , training_annotations_(training_annotations)
+        , offset_(offset)
+        , gradient_positive_(gradient_positive)
+        , gradient_negative_(gradient_negative)
+        , positive_stats_(positive_stats)
+        , progress_(progress)
+        , negative_fraction_(negative_fraction)
+        , hard_negative_mining_(hard_negative_mining)
+    {
+    }
+
+    void operator()(const cv::Range& range) const {
+        // each worker converts the samples with its own sonar holder
+        SonarHolder sonar_holder;
+
+        for (int k = range.start; k < range.end; k++) {
+            size_t i = offset_ + k;
+
+            gradient_positive_[k].clear();
+            gradient_negative_[k].clear();
+            positive_stats_[k].clear();
+
+            std::vector<cv::Point> annotation_points = training_annotations_[i];
+
+            if (!annotation_points.empty()) {
+                const base::samples::Sonar& sample = training_samples_[i];
+
+                sonar_holder.Reset(sample.bins,
+                    utils::get_radians(sample.bearings),
+                    sample.beam_width.getRad(),
+                    sample.bin_count,
+                    sample.beam_count,
+                    detector_.sonar_image_size_);
+
+                if (detector_.sonar_image_size_ != cv::Size(-1, -1)) {
+                    detector_.ResizeAnnotationPoints(sonar_holder, annotation_points, annotation_points);
+                }
+
+                if (hard_negative_mining_) {
+                    detector_.ComputeHardNegatives(
+                        sonar_holder.cart_image(),
+                        sonar_holder.cart_image_mask(),
+                        annotation_points,
+                        gradient_negative_[k]);
+                }
+                else {
+                    detector_.ComputeTrainingData(
+                        sonar_holder.cart_image(),
+                        sonar_holder.cart_image_mask(),
+                        annotation_points,
+                        gradient_positive_[k],
+                        gradient_negative_[k],
+                        positive_stats_[k]);
+
+                    if (negative_fraction_ < 1.0) {
+                        // the generator is seeded by the sample index to keep the subset deterministic
+                        cv::RNG rng(i + 1);
+                        SampleRows(rng, gradient_negative_[k]);
+                    }
+                }
+            }
+
+            progress_.Increment();
+        }
+    }
+
+private:
+    const HOGDetector& detector_;
+    const std::vector<base::samples::Sonar>& training_samples_;
+    const std::vector<std::vector<cv::Point> >& training_annotations_;
+    size_t offset_;
+    std::vector<std::vector<float> >& gradient_positive_;
+    std::vector<std::vector<float> >& gradient_negative_;
+    std::vector<std::vector<float> >& positive_stats_;
+    TrainingProgress& progress_;
+    double negative_fraction_;
+    bool hard_negative_mining_;
+
+    void SampleRows(cv::RNG& rng, std::vector<float>& rows) const {
+        const size_t cols = detector_.hog_descriptor_.getDescriptorSize();
+        const size_t total = rows.size() / cols;
+
+        size_t count = 0;
+        for (size_t i = 0; i < total; i++) {
+            if (rng.uniform(0.0, 1.0) < negative_fraction_) {
+                if (count != i) {
+                    std::copy(rows.begin() + i * cols, rows.begin() + (i + 1) * cols, rows.begin() + count * cols);
+                }
+                count++;
+            }
+        }
+        rows.resize(count * cols);
+    }
+};
+
 void HOGDetector::LoadTrainingData(
     const std::vector<base::samples::Sonar>& training_samples,
     const std::vector<std::vector<cv::Point> >& training_annotations,
-    std::vector<cv::Mat>& gradient_positive,
-    std::vector<cv::Mat>& gradient_negative)
+    double negative_fraction,
+    DescriptorMatrix& training_data,
+    std::vector<float>& positive_stats)
 {
-    printf("Extracting HOG from samples.\n\033[s");
-    for (size_t i = 0; i < training_samples.size(); i++) {
-        printf("\033[uSample: %ld of %ld",i, training_samples.size());
-        fflush(stdout);
+    const size_t total = training_samples.size();
+    const size_t chunk_size = std::max<size_t>(batch_chunk_size_, 1);
+
+    // only the descriptors of one chunk of samples are held in memory
+    std::vector<std::vector<float> > sample_positive(chunk_size);
+    std::vector<std::vector<float> > sample_negative(chunk_size);
+    std::vector<std::vector<float> > sample_positive_stats(chunk_size);
+
+    positive_stats.clear();
+
+    TrainingProgress progress(total);
+
+    int total_positive = 0;
+    int total_negative = 0;
+
+    for (size_t offset = 0; offset < total; offset += chunk_size) {
+        const size_t count = std::min(chunk_size, total - offset);
+
+        TrainingDataExtraction extraction(
+            *this,
+            training_samples,
+            training_annotations,
+            offset,
+            sample_positive,
+            sample_negative,
+            sample_positive_stats,
+            progress,
+            negative_fraction);
+
+        if (show_descriptor_ || show_positive_window_) {
+            // the highgui windows must be updated from a single thread
+            extraction(cv::Range(0, (int)count));
+        }
+        else {
+            cv::parallel_for_(cv::Range(0, (int)count), extraction);
+        }
 
-        base::samples::Sonar sample = training_samples[i];
+        // the descriptors are appended in the sample order, so the training
+        // data does not depend on the thread scheduling
+        for (size_t k = 0; k < count; k++) {
+            training_data.Append(sample_positive[k], +1);
+            training_data.Append(sample_negative[k], -1);
+            positive_stats.insert(positive_stats.end(), sample_positive_stats[k].begin(), sample_positive_stats[k].end());
+            total_positive += sample_positive[k].size() / training_data.cols();
+            total_negative += sample_negative[k].size() / training_data.cols();
+        }
+    }
 
-        sonar_holder_.Reset(sample.bins,
-            utils::get_radians(sample.bearings),
-            sample.beam_width.getRad(),
-            sample.bin_count,
-            sample.beam_count,
-            sonar_image_size_);
+    std::cout << std::endl;
+    std::cout << "Total Positive samples: " << total_positive << std::endl;
+    std::cout << "Total Negative samples: " << total_negative << std::endl;
+}
+
+void HOGDetector::LearnCascadeThresholds(std::vector<float>& positive_stats)
+{
+    const int STAGE_COUNT = 2;
 
-        sonar_source_image_ = sonar_holder_.cart_image();
-        sonar_source_mask_ = sonar_holder_.cart_image_mask();
+    cascade_min_mean_intensity_ = 0;
+    cascade_min_intensity_stddev_ = 0;
 
-        std::vector<cv::Point> annotation_points = training_annotations[i];
+    const size_t total = positive_stats.size() / STAGE_COUNT;
 
-        if (!annotation_points.empty()) {
+    if (total == 0) {
+        return;
+    }
+
+    // each stage may reject its share of the positives allowed by the target recall
+    double reject_fraction = (1.0 - cascade_target_recall_) / STAGE_COUNT;
+    size_t k = std::min((size_t)floor(std::max(reject_fraction, 0.0) * total), total - 1);
+
+    std::vector<float> means(total);
+    std::vector<float> stddevs(total);
+    for (size_t i = 0; i < total; i++) {
+        means[i] = positive_stats[i * STAGE_COUNT];
+        stddevs[i] = positive_stats[i * STAGE_COUNT + 1];
+    }
 
-            if (sonar_image_size_ != cv::Size(-1, -1)) {
-                ResizeAnnotationPoints(annotation_points, annotation_points);
+    std::nth_element(means.begin(), means.begin() + k, means.end());
+    std::nth_element(stddevs.begin(), stddevs.begin() + k, stddevs.end());
+
+    cascade_min_mean_intensity_ = means[k];
+    cascade_min_intensity_stddev_ = stddevs[k];
+
+    std::cout << "Cascade minimum mean intensity: " << cascade_min_mean_intensity_ << std::endl;
+    std::cout << "Cascade minimum intensity stddev: " << cascade_min_intensity_stddev_ << std::endl;
+}
+
+size_t HOGDetector::MineHardNegatives(
+    const std::vector<base::samples::Sonar>& training_samples,
+    const std::vector<std::vector<cv::Point> >& training_annotations,
+    DescriptorMatrix& training_data)
+{
+    const size_t total = training_samples.size();
+    const size_t chunk_size = std::max<size_t>(batch_chunk_size_, 1);
+    const size_t cols = training_data.cols();
+
+    const std::vector<int>& labels = training_data.labels();
+    size_t total_negative = std::count(labels.begin(), labels.end(), -1);
+
+    std::vector<std::vector<float> > sample_positive(chunk_size);
+    std::vector<std::vector<float> > sample_negative(chunk_size);
+    std::vector<std::vector<float> > sample_positive_stats(chunk_size);
+
+    TrainingProgress progress(total);
+
+    size_t total_mined = 0;
+
+    for (size_t offset = 0; offset < total; offset += chunk_size) {
+        if (max_negative_count_ > 0 && total_negative >= max_negative_count_) {
+            break;
+        }
+
+        const size_t count = std::min(chunk_size, total - offset);
+
+        TrainingDataExtraction extraction(
+            *this,
+            training_samples,
+            training_annotations,
+            offset,
+            sample_positive,
+            sample_negative,
+            sample_positive_stats,
+            progress,
+            1.0,
+            true);
+
+        if (show_descriptor_) {
+            extraction(cv::Range(0, (int)count));
+        }
+        else {
+            cv::parallel_for_(cv::Range(0, (int)count), extraction);
+        }
+
+        // append the false positives in the sample order until the negative pool is full
+        for (size_t k = 0; k < count; k++) {
+            size_t rows = sample_negative[k].size() / cols;
+
+            if (max_negative_count_ > 0) {
+                rows = std::min(rows, max_negative_count_ - std::min(total_negative, max_negative_count_));
             }
 
-            ComputeTrainingData(annotation_points, gradient_positive, gradient_negative);
+            if (rows > 0) {
+                training_data.Append(&sample_negative[k][0], (int)rows, -1);
+                total_negative += rows;
+                total_mined += rows;
+            }
         }
     }
-    printf("\n");
-    std::cout << "Total Positive samples: " << gradient_positive.size() << std::endl;
-    std::cout << "Total Negative samples: " << gradient_negative.size() << std::endl;
+
+    std::cout << std::endl;
+    return total_mined;
 }
 
 void HOGDetector::PerformPreprocessing(
+    const cv::Mat& source_image,
+    const cv::Mat& source_mask,
     cv::Mat& preprocessed_image,
-    cv::Mat& preprocessed_mask)
+    cv::Mat& preprocessed_mask) const
 {
     // perform the sonar image preprocessing
     if (sonar_image_size_ != cv::Size(-1, -1)) {
-        sonar_image_processing_.Apply(sonar_source_image_, sonar_source_mask_, preprocessed_image, preprocessed_mask);
+        sonar_image_processing_.Apply(source_image, source_mask, preprocessed_image, preprocessed_mask);
     }
     else {
-        sonar_image_processing_.Apply(sonar_source_image_, sonar_source_mask_, preprocessed_image, preprocessed_mask, 0.5);
+        sonar_image_processing_.Apply(source_image, source_mask, preprocessed_image, preprocessed_mask, 0.5);
     }
 }
 
@@ -413,10 +1458,10 @@ void HOGDetector::PrepareInput(
     cv::Mat& input_image,
     cv::Mat& input_mask,
     cv::Mat& input_annotation_mask,
-    double& rotated_angle)
+    double& rotated_angle) const
 {
     cv::Mat annotation_mask;
-    CreateAnnotationMask(sonar_source_image_.size(), annotation, annotation_mask);
+    CreateAnnotationMask(preprocessed_image.size(), annotation, annotation_mask);
 
     cv::Mat scaled_image;
     cv::resize(preprocessed_image, scaled_image, cv::Size(), scale_factor, scale_factor);
@@ -435,18 +1480,44 @@ void HOGDetector::PrepareInput(
 
 
 void HOGDetector::ComputeTrainingData(
+    const cv::Mat& source_image,
+    const cv::Mat& source_mask,
+    const std::vector<cv::Point>& annotation,
+    std::vector<float>& gradient_positive,
+    std::vector<float>& gradient_negative,
+    std::vector<float>& positive_stats) const
+{
+    cv::Mat input_image;
+    cv::Mat input_mask;
+    cv::Mat input_annotation_mask;
+    PrepareTrainingInput(source_image, source_mask, annotation, input_image, input_mask, input_annotation_mask);
+
+    // validate positive input
+    if (!positive_input_validate_ ||
+        (positive_input_validate_ &&
+        ValidatePositiveInput(input_mask, input_annotation_mask))) {
+        // compute positive gradients
+        ComputePositive(input_image, input_annotation_mask, gradient_positive, positive_stats);
+    }
+
+
+    // compute negative gradients
+    ComputeNegative(input_image, input_mask, input_annotation_mask, gradient_negative);
+}
+
+void HOGDetector::PrepareTrainingInput(
+    const cv::Mat& source_image,
+    const cv::Mat& source_mask,
     const std::vector<cv::Point>& annotation,
-    std::vector<cv::Mat>& gradient_positive,
-    std::vector<cv::Mat>& gradient_negative)
+    cv::Mat& input_image,
+    cv::Mat& input_mask,
+    cv::Mat& input_annotation_mask) const
 {
     // perform preprocessing
     cv::Mat preprocessed_image;
     cv::Mat preprocessed_mask;
-    PerformPreprocessing(preprocessed_image, preprocessed_mask);
+    PerformPreprocessing(source_image, source_mask, preprocessed_image, preprocessed_mask);
 
-    cv::Mat input_image;
-    cv::Mat input_mask;
-    cv::Mat input_annotation_mask;
     double rotated_angle;
 
     // prepare hog inputs
@@ -460,28 +1531,74 @@ void HOGDetector::ComputeTrainingData(
         input_annotation_mask,
         rotated_angle);
 
-    // cv::imshow("sonar_source_image", sonar_source_image_);
+    // cv::imshow("sonar_source_image", source_image);
     // cv::imshow("preprocessed_image", preprocessed_image);
     // cv::imshow("input_image", input_image);
     // cv::waitKey(15);
+}
 
-    // validate positive input
-    if (!positive_input_validate_ ||
-        (positive_input_validate_ &&
-        ValidatePositiveInput(input_mask, input_annotation_mask))) {
-        // compute positive gradients
-        ComputePositive(input_image, input_annotation_mask, gradient_positive);
+void HOGDetector::ComputeHardNegatives(
+    const cv::Mat& source_image,
+    const cv::Mat& source_mask,
+    const std::vector<cv::Point>& annotation,
+    std::vector<float>& gradient_list_negative) const
+{
+    cv::Mat input_image;
+    cv::Mat input_mask;
+    cv::Mat input_annotation_mask;
+    PrepareTrainingInput(source_image, source_mask, annotation, input_image, input_mask, input_annotation_mask);
+
+    cv::Mat negative_image;
+    cv::Mat negative_mask;
+    cv::Mat negative_annotation_mask;
+    PrepareNegativeInput(input_image, input_mask, input_annotation_mask,
+        negative_image, negative_mask, negative_annotation_mask);
+
+    if (window_size_.width > negative_image.cols ||
+        window_size_.height > negative_image.rows) {
+        return;
     }
 
+    // run the current detector over the negative region
+    std::vector<cv::Point> hits;
+    std::vector<double> weights;
+    hog_descriptor_.detect(negative_image, hits, weights, hard_negative_margin_, window_stride_, cv::Size(0, 0));
 
-    // compute negative gradients
-    ComputeNegative(input_image, input_mask, input_annotation_mask, gradient_negative);
+    if (hits.empty()) {
+        return;
+    }
+
+    // the hardest false positives first
+    std::vector<size_t> indices(weights.size());
+    for (size_t i = 0; i < indices.size(); i++) indices[i]=i;
+    std::sort(indices.begin(), indices.end(), sonar_processing::utils::IndexComparator<double>(weights));
+    std::reverse(indices.begin(), indices.end());
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        cv::Rect rc = cv::Rect(hits[indices[i]], window_size_);
+
+        if (IsNegativeWindow(negative_mask, negative_annotation_mask, rc)) {
+            cv::Mat hog_input_negative;
+            negative_image(rc).copyTo(hog_input_negative);
+            ComputeGradient(hog_input_negative, gradient_list_negative);
+        }
+    }
+}
+
+bool HOGDetector::IsNegativeWindow(
+    const cv::Mat& mask,
+    const cv::Mat& annotation_mask,
+    const cv::Rect& rc) const
+{
+    double m0 = cv::mean(mask(rc))[0]/255.0;
+    double m1 = cv::mean(annotation_mask(rc))[0]/255.0;
+    return m0 > 0.5 && m1 < 0.2;
 }
 
 void HOGDetector::CreateAnnotationMask(
      const cv::Size& size,
      const std::vector<cv::Point>& annotation,
-     cv::Mat& annotation_mask)
+     cv::Mat& annotation_mask) const
 {
     annotation_mask = cv::Mat::zeros(size, CV_8UC1);
     std::vector<std::vector<cv::Point> > contours;
@@ -497,7 +1614,7 @@ void HOGDetector::OrientationNormalize(
     cv::Mat& rotated_image,
     cv::Mat& rotated_mask,
     cv::Mat& rotated_annotation_mask,
-    double& rotated_angle)
+    double& rotated_angle) const
 {
     cv::Point2f center = cv::Point2f(source_image.cols/2, source_image.rows/2);
     rotated_angle = (bbox.size.width>=bbox.size.height) ? bbox.angle : bbox.angle+90;
@@ -511,7 +1628,7 @@ void HOGDetector::RotateInput(
     const cv::Point2f& center,
     double angle,
     cv::Mat& rotated_image,
-    cv::Mat& rotated_mask)
+    cv::Mat& rotated_mask) const
 {
     image_util::rotate(source_image, rotated_image, angle, center);
     image_util::rotate(source_mask, rotated_mask, angle, center);
@@ -520,11 +1637,18 @@ void HOGDetector::RotateInput(
 void HOGDetector::ComputePositive(
     const cv::Mat& source_image,
     const cv::Mat& annotation_mask,
-    std::vector<cv::Mat>& gradient_list_positive)
+    std::vector<float>& gradient_list_positive,
+    std::vector<float>& positive_stats) const
 {
     cv::Mat input_image;
     PreparePositiveInput(source_image, annotation_mask, input_image);
 
+    // the window intensity statistics used to learn the cascade stages
+    cv::Scalar mean, stddev;
+    cv::meanStdDev(input_image, mean, stddev);
+    positive_stats.push_back(mean[0]);
+    positive_stats.push_back(stddev[0]);
+
     if (show_positive_window_) {
         image_util::show_scale("positive_input_image", input_image, 1.5);
         cv::waitKey(15);
@@ -536,7 +1660,7 @@ void HOGDetector::ComputePositive(
 void HOGDetector::PreparePositiveInput(
     const cv::Mat& source_image,
     const cv::Mat& annotation_mask,
-    cv::Mat& result_image)
+    cv::Mat& result_image) const
 {
     cv::Rect bounding_rect = image_util::get_bounding_rect(annotation_mask);
     result_image = source_image(bounding_rect);
@@ -549,7 +1673,7 @@ void HOGDetector::ComputeNegative(
     const cv::Mat& source_image,
     const cv::Mat& source_mask,
     const cv::Mat& annotation_mask,
-    std::vector<cv::Mat>& gradient_list_negative)
+    std::vector<float>& gradient_list_negative) const
 {
 
     cv::Mat input_image;
@@ -568,7 +1692,7 @@ void HOGDetector::PrepareNegativeInput(
     const cv::Mat& annotation_mask,
     cv::Mat& result_image,
     cv::Mat& result_mask,
-    cv::Mat& result_annotation_mask)
+    cv::Mat& result_annotation_mask) const
 {
     // copy region of interest
     cv::Rect bounding_rect = image_util::get_bounding_rect(source_mask);
@@ -583,7 +1707,7 @@ void HOGDetector::ComputeNegativeGradient(
     const cv::Mat& src,
     const cv::Mat& mask,
     const cv::Mat& annotation_mask,
-    std::vector<cv::Mat>& gradient_list_negative)
+    std::vector<float>& gradient_list_negative) const
 {
    cv::Size sz = src.size();
    cv::Size win = window_size_;
@@ -607,10 +1731,7 @@ void HOGDetector::ComputeNegativeGradient(
 
            cv::Rect rc = cv::Rect(xx, yy, win.width, win.height);
 
-           double m0 = cv::mean(mask(rc))[0]/255.0;
-           double m1 = cv::mean(annotation_mask(rc))[0]/255.0;
-
-           if (m0 > 0.5 && m1 < 0.2) {
+           if (IsNegativeWindow(mask, annotation_mask, rc)) {
                cv::Mat hog_input_negative;
                src(rc).copyTo(hog_input_negative);
                ComputeGradient(hog_input_negative, gradient_list_negative);
@@ -622,15 +1743,15 @@ void HOGDetector::ComputeNegativeGradient(
 
 void HOGDetector::ComputeGradient(
     const cv::Mat& source_image,
-    std::vector<cv::Mat>& gradient_list)
+    std::vector<float>& gradient_list) const
 {
-    cv::Mat gray;
     std::vector<cv::Point> location;
     std::vector<float> descriptors;
 
     hog_descriptor_.compute(source_image, descriptors, cv::Size(8, 8), cv::Size(0, 0), location);
 
-    gradient_list.push_back(cv::Mat(descriptors).clone());
+    // the descriptors are stored as consecutive rows
+    gradient_list.insert(gradient_list.end(), descriptors.begin(), descriptors.end());
 
     if (show_descriptor_) {
         cv::Mat rgb;
@@ -641,46 +1762,43 @@ void HOGDetector::ComputeGradient(
 
 }
 
-void HOGDetector::PrepareTrainingData(
-    const std::vector<cv::Mat>& positive,
-    const std::vector<cv::Mat>& negative,
-    std::vector<int>& labels,
-    cv::Mat& training_data)
+void HOGDetector::SVMTrain(
+    DescriptorMatrix& training_data,
+    const std::string& training_filename,
+    std::vector<float>& hog_detector)
 {
-    assert(!positive.empty());
-    assert(!negative.empty());
-
-    labels.clear();
-    labels.insert(labels.end(), positive.size(), +1);
-    labels.insert(labels.end(), negative.size(), -1);
-
-    std::vector<cv::Mat> train_samples;
-    train_samples.insert(train_samples.end(), positive.begin(), positive.end());
-    train_samples.insert(train_samples.end(), negative.begin(), negative.end());
-
-    const int rows = (int)train_samples.size();
-    const int cols = (int)std::max(train_samples[0].cols, train_samples[0].rows);
+    bool binary_model = DetectorModel::IsModelFilename(training_filename);
 
-    training_data = cv::Mat(rows, cols, CV_32FC1);
-
-    cv::Mat train_sample;
-    std::vector<cv::Mat>::const_iterator itr = train_samples.begin();
-    std::vector<cv::Mat>::const_iterator end = train_samples.end();
-    for(int i = 0 ; itr != end ; ++itr, ++i) {
-        itr->copyTo(train_sample);
-        CV_Assert(train_sample.cols == 1 || train_sample.rows == 1);
+    if (svm_trainer_type_ == kEpsilonSVRTrainer) {
+        EpsilonSVRTrain(training_data, (binary_model) ? "" : training_filename, hog_detector);
+    }
+    else {
+        linear_svm_trainer_.Train(training_data.Map(), training_data.labels(), hog_detector);
 
-        if(train_sample.cols == 1) {
-            cv::transpose(train_sample, train_sample);
+        if (!training_filename.empty() && !binary_model) {
+            cv::FileStorage fs(training_filename, cv::FileStorage::WRITE);
+            fs << "hog_detector" << hog_detector;
+            fs << "cascade_min_mean_intensity" << cascade_min_mean_intensity_;
+            fs << "cascade_min_intensity_stddev" << cascade_min_intensity_stddev_;
         }
+    }
 
-        train_sample.copyTo(training_data.row(i));
+    if (binary_model) {
+        DetectorModel::Save(
+            training_filename,
+            hog_descriptor_,
+            training_scale_factor_,
+            detection_scale_factor_,
+            cascade_min_mean_intensity_,
+            cascade_min_intensity_stddev_,
+            hog_detector);
     }
 }
-void HOGDetector::SVMTrain(
-    const std::vector<int>& labels,
-    const cv::Mat& training_data,
-    const std::string& training_filename)
+
+void HOGDetector::EpsilonSVRTrain(
+    DescriptorMatrix& training_data,
+    const std::string& training_filename,
+    std::vector<float>& hog_detector)
 {
     // Set up SVM's parameters
     cv::SVMParams params;
@@ -694,8 +1812,16 @@ void HOGDetector::SVMTrain(
     params.C = 0.01;
     params.svm_type = CvSVM::EPS_SVR;
     LinearSVM svm;
-    svm.train(training_data, cv::Mat(labels), cv::Mat(), cv::Mat(), params);
-    svm.save(training_filename.c_str());
+    svm.train(training_data.Map(), cv::Mat(training_data.labels()), cv::Mat(), cv::Mat(), params);
+    svm.get_detector(hog_detector);
+
+    if (!training_filename.empty()) {
+        // CvStatModel::load reads the first node, so the thresholds are written after the model
+        cv::FileStorage fs(training_filename, cv::FileStorage::WRITE);
+        svm.write(*fs, "my_svm");
+        fs << "cascade_min_mean_intensity" << cascade_min_mean_intensity_;
+        fs << "cascade_min_intensity_stddev" << cascade_min_intensity_stddev_;
+    }
 }
 
 void HOGDetector::TransformLocation(
@@ -718,7 +1844,7 @@ void HOGDetector::TransformLocation(
         rc.width = (*it).width/scale;
         rc.height = (*it).height/scale;
         cv::rectangle(mask, rc, cv::Scalar(255), CV_FILLED);
-        image_util::rotate(mask, mask, rotate, center, sonar_source_image_.size());
+        image_util::rotate(mask, mask, rotate, center, sonar_source_size_);
         std::vector<cv::Point> contours = preprocessing::find_biggest_contour(mask);
         cv::RotatedRect bbox = cv::minAreaRect(contours);
         if (bbox.size.width<bbox.size.height) {
@@ -733,14 +1859,15 @@ void HOGDetector::TransformLocation(
 }
 
 void HOGDetector::ResizeAnnotationPoints(
+    const SonarHolder& sonar_holder,
     const std::vector<cv::Point>& source_points,
-    std::vector<cv::Point>& result_points)
+    std::vector<cv::Point>& result_points) const
 {
     image_util::resize_points(
         source_points,
         result_points,
-        sonar_holder_.cart_width_factor(),
-        sonar_holder_.cart_height_factor());
+        sonar_holder.cart_width_factor(),
+        sonar_holder.cart_height_factor());
 }
 
 void HOGDetector::FilterLocationInsideMask(
@@ -748,69 +1875,63 @@ void HOGDetector::FilterLocationInsideMask(
     const std::vector<double>& weights,
     std::vector<cv::Rect>& result_locations,
     std::vector<double>& result_weights,
-    const cv::Mat& input,
-    const cv::Mat& mask)
+    const cv::Mat& mask_integral)
 {
-    cv::Mat mat = cv::Mat::zeros(input.size(), CV_8UC1);
+    const size_t total = locations.size();
+
+    std::vector<double> coverage(total);
+    for (size_t i = 0; i < total; i++) {
+        coverage[i] = mask_coverage(mask_integral, locations[i]);
+    }
 
     std::vector<cv::Rect> new_locations;
     std::vector<double> new_weights;
-    for (size_t i = 0; i < locations.size(); i++) {
-        mat.setTo(0);
-        cv::rectangle(mat, locations[i], cv::Scalar(255), CV_FILLED);
+    new_locations.reserve(total);
+    new_weights.reserve(total);
 
-        cv::Mat res;
-        cv::bitwise_and(mat, mask, res);
-        double area = (cv::sum(res)[0] / cv::sum(mat)[0]);
-
-        if (area > 0.75) {
+    for (size_t i = 0; i < total; i++) {
+        if (coverage[i] > 0.75) {
             new_locations.push_back(locations[i]);
             new_weights.push_back(weights[i]);
         }
     }
-    result_locations = new_locations;
-    result_weights = new_weights;
+
+    result_locations.swap(new_locations);
+    result_weights.swap(new_weights);
 }
 
 bool HOGDetector::ValidatePositiveInput(
     const cv::Mat& mask,
-    const cv::Mat& annotation_mask)
+    const cv::Mat& annotation_mask) const
 {
     cv::Mat res;
     cv::bitwise_and(mask, annotation_mask, res);
     return (cv::sum(res)[0] / cv::sum(annotation_mask)[0]) > 0.7;
 }
 
-cv::Rect HOGDetector::GetLastDetectedBoundingRect(
+cv::Rect HOGDetector::GetTrackingBoundingRect(
+    const cv::RotatedRect& location,
+    double margin,
     double scale,
     cv::Size max_size)
 {
     const float PADDING_FACTOR = 0.2;
 
-    cv::Rect bbox = last_detected_location_.boundingRect();
+    cv::Rect bbox = location.boundingRect();
     bbox.x *= scale;
     bbox.y *= scale;
     bbox.width *= scale;
     bbox.height *= scale;
 
-    int padx = bbox.width * PADDING_FACTOR;
-    int pady = bbox.height * PADDING_FACTOR;
+    int padx = bbox.width * PADDING_FACTOR + margin * scale;
+    int pady = bbox.height * PADDING_FACTOR + margin * scale;
 
     bbox.x -= padx;
     bbox.y -= pady;
     bbox.width += padx*2;
     bbox.height  += pady*2;
 
-    if (bbox.x < 0) bbox.x = 0;
-    if (bbox.y < 0) bbox.y = 0;
-
-    int w = max_size.width;
-    int h = max_size.height;
-
-    if (bbox.width >= w) bbox.width = w-bbox.x;
-    if (bbox.height >= h) bbox.height = h-bbox.y;
-
-    return bbox;
+    return bbox & cv::Rect(cv::Point(0, 0), max_size);
 }
 
 } /* namespace sonar_processing */
@@ -4,8 +4,13 @@
 #include <vector>
 #include <base/samples/Sonar.hpp>
 #include <opencv2/opencv.hpp>
+#include "DescriptorMatrix.hpp"
+#include "DetectionClustering.hpp"
+#include "IntegerHOG.hpp"
+#include "LinearSVMTrainer.hpp"
 #include "SonarHolder.hpp"
 #include "SonarImagePreprocessing.hpp"
+#include "TrackingFilter.hpp"
 
 namespace sonar_processing {
 
@@ -14,6 +19,40 @@ class HOGDetector
 
 public:
 
+    enum SVMTrainerType {
+        kEpsilonSVRTrainer = 0,
+        kLinearSVMTrainer = 1
+    };
+
+    /**
+     * A target followed by the multi-target detection.
+     */
+    struct Track {
+        int id;
+        cv::RotatedRect location;
+        double weight;
+        // the number of frames where the target was detected
+        int hit_count;
+        // the number of consecutive frames where the target was missed
+        int miss_count;
+    };
+
+    /**
+     * The agreement between the float and the fixed point detectors.
+     */
+    struct IntegerHOGEvaluation {
+        size_t window_count;
+        // the windows with a positive score
+        size_t float_hit_count;
+        size_t integer_hit_count;
+        size_t common_hit_count;
+        double mean_score_error;
+        double max_score_error;
+        // the detection time, in seconds
+        double float_time;
+        double integer_time;
+    };
+
     HOGDetector();
     ~HOGDetector();
 
@@ -30,6 +69,27 @@ public:
         succeeded_detect_count_ = 0;
         failed_detect_count_ = 0;
         memset(&last_detected_location_, 0, sizeof(last_detected_location_));
+        tracking_filter_.Clear();
+    }
+
+    void reset_tracks() {
+        tracks_.clear();
+        frame_count_ = 0;
+    }
+
+    // the number of frames between the complete sweeps of the multi-target detection
+    void set_full_sweep_interval(int full_sweep_interval) {
+        full_sweep_interval_ = full_sweep_interval;
+    }
+
+    // the number of consecutive missed frames before a track is dropped
+    void set_max_track_misses(int max_track_misses) {
+        max_track_misses_ = max_track_misses;
+    }
+
+    // the maximum distance between a track prediction and its detection
+    void set_track_gate_distance(double track_gate_distance) {
+        track_gate_distance_ = track_gate_distance;
     }
 
     void set_show_descriptor(bool show_descriptor) {
@@ -72,6 +132,11 @@ public:
         sonar_image_processing_.set_border_filter_enable(p.border_filter_enable());
     }
 
+    // run the preprocessing directly at the detection scale instead of the source scale
+    void set_detection_scale_preprocessing(bool detection_scale_preprocessing) {
+        detection_scale_preprocessing_ = detection_scale_preprocessing;
+    }
+
     void set_detection_scale_factor(double detection_scale_factor) {
         detection_scale_factor_ = detection_scale_factor;
     }
@@ -84,10 +149,93 @@ public:
         orientation_step_ = orientation_step;
     }
 
+    // the maximum half range of the tracking orientation sweep
     void set_orientation_range(double orientation_range) {
         orientation_range_ = orientation_range;
     }
 
+    cv::Size sonar_image_size() const {
+        return sonar_image_size_;
+    }
+
+    void set_batch_chunk_size(size_t batch_chunk_size) {
+        batch_chunk_size_ = batch_chunk_size;
+    }
+
+    void set_training_matrix_filename(const std::string& training_matrix_filename) {
+        training_matrix_filename_ = training_matrix_filename;
+    }
+
+    // the number of retraining rounds with hard negatives, zero disables the mining
+    void set_hard_negative_mining_rounds(int hard_negative_mining_rounds) {
+        hard_negative_mining_rounds_ = hard_negative_mining_rounds;
+    }
+
+    // the fraction of the grid negatives used to train the first model
+    void set_initial_negative_fraction(double initial_negative_fraction) {
+        initial_negative_fraction_ = initial_negative_fraction;
+    }
+
+    // the minimum score of a false positive to be added to the negative pool
+    void set_hard_negative_margin(double hard_negative_margin) {
+        hard_negative_margin_ = hard_negative_margin;
+    }
+
+    // the maximum size of the negative pool, zero means no limit
+    void set_max_negative_count(size_t max_negative_count) {
+        max_negative_count_ = max_negative_count;
+    }
+
+    // the motion model of the tracked detection
+    TrackingFilter& tracking_filter() {
+        return tracking_filter_;
+    }
+
+    // the clustering of the detections found in the orientation sweep
+    DetectionClustering& detection_clustering() {
+        return detection_clustering_;
+    }
+
+    // score only the windows proposed from the preprocessed intensity
+    void set_proposal_enable(bool proposal_enable) {
+        proposal_enable_ = proposal_enable;
+    }
+
+    // the minimum ratio between the window mean intensity and the image mean intensity
+    void set_proposal_intensity_ratio(double proposal_intensity_ratio) {
+        proposal_intensity_ratio_ = proposal_intensity_ratio;
+    }
+
+    // reject the windows with the intensity stages learned in the training
+    void set_cascade_enable(bool cascade_enable) {
+        cascade_enable_ = cascade_enable;
+    }
+
+    // the fraction of the training positives accepted by the cascade stages
+    void set_cascade_target_recall(double cascade_target_recall) {
+        cascade_target_recall_ = cascade_target_recall;
+    }
+
+    // score the windows with the fixed point detector, the float detector is
+    // used when the descriptor parameters cannot be quantized
+    void set_integer_hog_enable(bool integer_hog_enable) {
+        integer_hog_enable_ = integer_hog_enable;
+    }
+
+    void set_svm_trainer_type(SVMTrainerType svm_trainer_type) {
+        svm_trainer_type_ = svm_trainer_type;
+    }
+
+    // the parameters of the primal linear trainer
+    LinearSVMTrainer& linear_svm_trainer() {
+        return linear_svm_trainer_;
+    }
+
+    /**
+     * Load a model saved by Train. The binary models (".bin") also restore the
+     * HOG parameters and scale factors used in the training, the detector
+     * vector written by the linear trainer and the CvSVM models are also accepted.
+     */
     void LoadSVMTrain(const std::string& svm_model_filename);
 
     bool Detect(
@@ -109,18 +257,97 @@ public:
         std::vector<cv::RotatedRect>& locations,
         std::vector<double>& found_weights);
 
+    /**
+     * Score every window of the samples, without rotation, with the float
+     * and the fixed point detectors and compare the results.
+     */
+    IntegerHOGEvaluation EvaluateIntegerHOG(
+        const std::vector<base::samples::Sonar>& samples);
+
+    /**
+     * Detect and track several targets.
+     * New targets are searched by a complete sweep every full_sweep_interval
+     * frames, while the known targets are searched around their predicted
+     * location in the other frames.
+     * @param tracks: the live tracks, the ones detected in this frame have miss_count zero
+     * @return true if any target was detected in this frame
+     */
+    bool DetectTargets(
+        const cv::Mat& sonar_source_image,
+        const cv::Mat& sonar_source_mask,
+        std::vector<Track>& tracks);
+
+    bool DetectTargetsPreprocessed(
+        const cv::Mat& scaled_image,
+        const cv::Mat& scaled_mask,
+        cv::Size sonar_source_size,
+        std::vector<Track>& tracks);
+
+    /**
+     * Run the sonar image preprocessing and scale the result to the detection size.
+     * It does not change the detector state, so it can run on a different thread
+     * than the detection.
+     */
+    void Preprocess(
+        const cv::Mat& sonar_source_image,
+        const cv::Mat& sonar_source_mask,
+        cv::Mat& scaled_image,
+        cv::Mat& scaled_mask) const;
+
+    /**
+     * Run the detection sweep on an image produced by Preprocess.
+     * @param sonar_source_size: the size of the source image given to Preprocess
+     */
+    bool DetectPreprocessed(
+        const cv::Mat& scaled_image,
+        const cv::Mat& scaled_mask,
+        cv::Size sonar_source_size,
+        std::vector<cv::RotatedRect>& locations,
+        std::vector<double>& found_weights);
+
+    /**
+     * Run the tracking detection over a range of samples, as used to reprocess logs.
+     * The polar to cartesian conversion and the preprocessing of each chunk of
+     * samples run in parallel, while the detection follows the sample order, so
+     * the results and the tracking state match a sequential run of Detect.
+     */
+    void DetectBatch(
+        std::vector<base::samples::Sonar>::const_iterator first,
+        std::vector<base::samples::Sonar>::const_iterator last,
+        std::vector<std::vector<cv::RotatedRect> >& locations,
+        std::vector<std::vector<double> >& found_weights,
+        std::vector<uchar>& detected);
 
 private:
 
+    struct TrackState {
+        Track track;
+        TrackingFilter filter;
+    };
+
+    friend class TrainingDataExtraction;
+
+    void SetSVMDetector(const std::vector<float>& hog_detector);
+
     void LoadTrainingData(
         const std::vector<base::samples::Sonar>& training_samples,
         const std::vector<std::vector<cv::Point> >& training_annotations,
-        std::vector<cv::Mat>& gradient_positive,
-        std::vector<cv::Mat>& gradient_negative);
+        double negative_fraction,
+        DescriptorMatrix& training_data,
+        std::vector<float>& positive_stats);
+
+    void LearnCascadeThresholds(std::vector<float>& positive_stats);
+
+    size_t MineHardNegatives(
+        const std::vector<base::samples::Sonar>& training_samples,
+        const std::vector<std::vector<cv::Point> >& training_annotations,
+        DescriptorMatrix& training_data);
 
     void PerformPreprocessing(
+        const cv::Mat& source_image,
+        const cv::Mat& source_mask,
         cv::Mat& preprocessed_image,
-        cv::Mat& preprocessed_mask);
+        cv::Mat& preprocessed_mask) const;
 
     void PrepareInput(
         const cv::Mat& preprocessed_image,
@@ -130,25 +357,47 @@ private:
         cv::Mat& input_image,
         cv::Mat& input_mask,
         cv::Mat& annotation_mask,
-        double& rotated_angle);
+        double& rotated_angle) const;
 
     void PrepareInput(
         const cv::Mat& preprocessed_image,
         const cv::Mat& preprocessed_mask,
         double scale_factor,
         cv::Mat& input_image,
-        cv::Mat& input_mask);
+        cv::Mat& input_mask) const;
 
 
     void ComputeTrainingData(
+        const cv::Mat& source_image,
+        const cv::Mat& source_mask,
+        const std::vector<cv::Point>& annotation,
+        std::vector<float>& gradient_positive,
+        std::vector<float>& gradient_negative,
+        std::vector<float>& positive_stats) const;
+
+    void PrepareTrainingInput(
+        const cv::Mat& source_image,
+        const cv::Mat& source_mask,
+        const std::vector<cv::Point>& annotation,
+        cv::Mat& input_image,
+        cv::Mat& input_mask,
+        cv::Mat& input_annotation_mask) const;
+
+    void ComputeHardNegatives(
+        const cv::Mat& source_image,
+        const cv::Mat& source_mask,
         const std::vector<cv::Point>& annotation,
-        std::vector<cv::Mat>& gradient_positive,
-        std::vector<cv::Mat>& gradient_negative);
+        std::vector<float>& gradient_list_negative) const;
+
+    bool IsNegativeWindow(
+        const cv::Mat& mask,
+        const cv::Mat& annotation_mask,
+        const cv::Rect& rc) const;
 
     void CreateAnnotationMask(
         const cv::Size& size,
         const std::vector<cv::Point>& annotation,
-        cv::Mat& annotation_mask);
+        cv::Mat& annotation_mask) const;
 
 
     void OrientationNormalize(
@@ -159,23 +408,24 @@ private:
         cv::Mat& rotated_image,
         cv::Mat& rotated_mask,
         cv::Mat& rotated_annotation_mask,
-        double& rotated_angle);
+        double& rotated_angle) const;
 
     void PreparePositiveInput(
         const cv::Mat& source_image,
         const cv::Mat& annotation_mask,
-        cv::Mat& result_image);
+        cv::Mat& result_image) const;
 
     void ComputePositive(
         const cv::Mat& source_image,
         const cv::Mat& annotation_mask,
-        std::vector<cv::Mat>& gradient_list_positive);
+        std::vector<float>& gradient_list_positive,
+        std::vector<float>& positive_stats) const;
 
     void ComputeNegative(
         const cv::Mat& source_image,
         const cv::Mat& source_mask,
         const cv::Mat& annotation_mask,
-        std::vector<cv::Mat>& gradient_list_negative);
+        std::vector<float>& gradient_list_negative) const;
 
     void PrepareNegativeInput(
         const cv::Mat& source_image,
@@ -183,29 +433,28 @@ private:
         const cv::Mat& annotation_mask,
         cv::Mat& result_image,
         cv::Mat& result_mask,
-        cv::Mat& result_annotation_mask);
+        cv::Mat& result_annotation_mask) const;
 
 
     void ComputeNegativeGradient(
         const cv::Mat& src,
         const cv::Mat& mask,
         const cv::Mat& annotation_mask,
-        std::vector<cv::Mat>& gradient_list_negative);
+        std::vector<float>& gradient_list_negative) const;
 
     void ComputeGradient(
         const cv::Mat& source_image,
-        std::vector<cv::Mat>& gradient_list);
-
-    void PrepareTrainingData(
-        const std::vector<cv::Mat>& positive,
-        const std::vector<cv::Mat>& negative,
-        std::vector<int>& labels,
-        cv::Mat& training_data);
+        std::vector<float>& gradient_list) const;
 
     void SVMTrain(
-        const std::vector<int>& labels,
-        const cv::Mat& training_data,
-        const std::string& training_filename);
+        DescriptorMatrix& training_data,
+        const std::string& training_filename,
+        std::vector<float>& hog_detector);
+
+    void EpsilonSVRTrain(
+        DescriptorMatrix& training_data,
+        const std::string& training_filename,
+        std::vector<float>& hog_detector);
 
     void TransformLocation(
         const std::vector<cv::Rect>& locations,
@@ -216,8 +465,9 @@ private:
         std::vector<cv::RotatedRect>& rotated_locations);
 
     void ResizeAnnotationPoints(
+        const SonarHolder& sonar_holder,
         const std::vector<cv::Point>& source_points,
-        std::vector<cv::Point>& result_points);
+        std::vector<cv::Point>& result_points) const;
 
 
     void FilterLocationInsideMask(
@@ -225,12 +475,11 @@ private:
         const std::vector<double>& weights,
         std::vector<cv::Rect>& result_locations,
         std::vector<double>& result_weights,
-        const cv::Mat& input,
-        const cv::Mat& mask);
+        const cv::Mat& mask_integral);
 
     bool ValidatePositiveInput(
         const cv::Mat& mask,
-        const cv::Mat& annotation_mask);
+        const cv::Mat& annotation_mask) const;
 
     void RotateInput(
         const cv::Mat& source_image,
@@ -238,7 +487,7 @@ private:
         const cv::Point2f& center,
         double angle,
         cv::Mat& rotated_image,
-        cv::Mat& rotated_mask);
+        cv::Mat& rotated_mask) const;
 
     bool PerformDetect(
         const cv::Mat& source_image,
@@ -247,6 +496,21 @@ private:
         std::vector<cv::RotatedRect>& locations,
         std::vector<double>& found_weights);
 
+    void DetectProposals(
+        const cv::Mat& input_image,
+        const cv::Mat& input_mask,
+        const cv::Mat& mask_integral,
+        std::vector<cv::Rect>& locations,
+        std::vector<double>& weights);
+
+    void ComputeProposals(
+        const cv::Mat& image,
+        const cv::Mat& mask_integral,
+        double scale,
+        double min_mean_intensity,
+        double min_intensity_stddev,
+        std::vector<cv::Point>& proposals) const;
+
     void RotateAndDetect(
         const cv::Mat& source_image,
         const cv::Mat& source_mask,
@@ -263,7 +527,28 @@ private:
         double& best_weight,
         cv::RotatedRect &best_location);
 
-    cv::Rect GetLastDetectedBoundingRect(
+    void SearchTrackedLocation(
+        const cv::Mat& scaled_image,
+        const cv::Mat& scaled_mask,
+        const TrackingFilter& filter,
+        const cv::RotatedRect& predicted_location,
+        bool complete_sweep,
+        std::vector<cv::RotatedRect>& locations,
+        std::vector<double>& found_weights);
+
+    void UpdateTrack(
+        TrackState& state,
+        const cv::RotatedRect& location,
+        double weight);
+
+    void AssociateDetections(
+        const std::vector<cv::RotatedRect>& predicted_locations,
+        const std::vector<cv::RotatedRect>& locations,
+        std::vector<int>& assigned_tracks) const;
+
+    cv::Rect GetTrackingBoundingRect(
+        const cv::RotatedRect& location,
+        double margin,
         double scale,
         cv::Size max_size);
 
@@ -273,6 +558,7 @@ private:
 
     double training_scale_factor_;
     double detection_scale_factor_;
+    bool detection_scale_preprocessing_;
     double detection_minimum_weight_;
 
     bool show_descriptor_;
@@ -280,10 +566,9 @@ private:
     bool positive_input_validate_;
 
     cv::HOGDescriptor hog_descriptor_;
-    cv::Mat sonar_source_image_;
-    cv::Mat sonar_source_mask_;
 
     cv::Size sonar_image_size_;
+    cv::Size sonar_source_size_;
 
     double image_scale_;
     cv::Size window_stride_;
@@ -293,8 +578,42 @@ private:
 
     cv::RotatedRect last_detected_location_;
 
+    TrackingFilter tracking_filter_;
+
+    std::vector<TrackState> tracks_;
+    int next_track_id_;
+    int frame_count_;
+    int full_sweep_interval_;
+    int max_track_misses_;
+    double track_gate_distance_;
+
     int succeeded_detect_count_;
     int failed_detect_count_;
+
+    size_t batch_chunk_size_;
+
+    std::string training_matrix_filename_;
+
+    int hard_negative_mining_rounds_;
+    double initial_negative_fraction_;
+    double hard_negative_margin_;
+    size_t max_negative_count_;
+
+    SVMTrainerType svm_trainer_type_;
+    LinearSVMTrainer linear_svm_trainer_;
+
+    DetectionClustering detection_clustering_;
+
+    bool proposal_enable_;
+    double proposal_intensity_ratio_;
+
+    bool cascade_enable_;
+    double cascade_target_recall_;
+    double cascade_min_mean_intensity_;
+    double cascade_min_intensity_stddev_;
+
+    IntegerHOG integer_hog_;
+    bool integer_hog_enable_;
 };
 
 } /* namespace sonar_processing*/
@@ -0,0 +1,131 @@
+#include <stdexcept>
+#include "Utils.hpp"
+#include "HOGDetectorPipeline.hpp"
+
+namespace sonar_processing {
+
+HOGDetectorPipeline::HOGDetectorPipeline(HOGDetector& detector, size_t queue_capacity)
+    : detector_(detector)
+    , listener_(NULL)
+    , input_queue_(queue_capacity)
+    , preprocessed_queue_(queue_capacity)
+    , next_frame_id_(0)
+    , running_(false)
+{
+}
+
+HOGDetectorPipeline::~HOGDetectorPipeline() {
+    Stop();
+}
+
+void HOGDetectorPipeline::Start(Listener* listener) {
+    if (running_) {
+        return;
+    }
+
+    listener_ = listener;
+    input_queue_.open();
+    preprocessed_queue_.open();
+
+    if (pthread_create(&preprocessing_thread_, NULL, &HOGDetectorPipeline::PreprocessingThread, this) != 0) {
+        throw std::runtime_error("failed to create the preprocessing thread");
+    }
+
+    if (pthread_create(&detection_thread_, NULL, &HOGDetectorPipeline::DetectionThread, this) != 0) {
+        input_queue_.close();
+        pthread_join(preprocessing_thread_, NULL);
+        throw std::runtime_error("failed to create the detection thread");
+    }
+
+    running_ = true;
+}
+
+void HOGDetectorPipeline::Stop() {
+    if (!running_) {
+        return;
+    }
+
+    input_queue_.close();
+    preprocessed_queue_.close();
+    pthread_join(preprocessing_thread_, NULL);
+    pthread_join(detection_thread_, NULL);
+    running_ = false;
+}
+
+uint64_t HOGDetectorPipeline::Push(const base::samples::Sonar& sample) {
+    Frame frame;
+    frame.id = next_frame_id_++;
+    frame.from_sample = true;
+    frame.sample = sample;
+    frame.time = sample.time;
+    input_queue_.push(frame);
+    return frame.id;
+}
+
+uint64_t HOGDetectorPipeline::Push(const cv::Mat& sonar_source_image, const cv::Mat& sonar_source_mask, base::Time time) {
+    Frame frame;
+    frame.id = next_frame_id_++;
+    frame.time = time;
+    sonar_source_image.copyTo(frame.image);
+    sonar_source_mask.copyTo(frame.mask);
+    input_queue_.push(frame);
+    return frame.id;
+}
+
+void* HOGDetectorPipeline::PreprocessingThread(void* arg) {
+    static_cast<HOGDetectorPipeline*>(arg)->RunPreprocessing();
+    return NULL;
+}
+
+void* HOGDetectorPipeline::DetectionThread(void* arg) {
+    static_cast<HOGDetectorPipeline*>(arg)->RunDetection();
+    return NULL;
+}
+
+void HOGDetectorPipeline::RunPreprocessing() {
+    Frame frame;
+    while (input_queue_.pop(frame)) {
+
+        if (frame.from_sample) {
+            sonar_holder_.Reset(
+                frame.sample.bins,
+                utils::get_radians(frame.sample.bearings),
+                frame.sample.beam_width.getRad(),
+                frame.sample.bin_count,
+                frame.sample.beam_count,
+                detector_.sonar_image_size());
+
+            frame.image = sonar_holder_.cart_image();
+            frame.mask = sonar_holder_.cart_image_mask();
+        }
+
+        PreprocessedFrame preprocessed;
+        preprocessed.id = frame.id;
+        preprocessed.time = frame.time;
+        preprocessed.source_size = frame.image.size();
+        detector_.Preprocess(frame.image, frame.mask, preprocessed.scaled_image, preprocessed.scaled_mask);
+
+        preprocessed_queue_.push(preprocessed);
+    }
+}
+
+void HOGDetectorPipeline::RunDetection() {
+    PreprocessedFrame preprocessed;
+    while (preprocessed_queue_.pop(preprocessed)) {
+        Result result;
+        result.frame_id = preprocessed.id;
+        result.time = preprocessed.time;
+        result.detected = detector_.DetectPreprocessed(
+            preprocessed.scaled_image,
+            preprocessed.scaled_mask,
+            preprocessed.source_size,
+            result.locations,
+            result.found_weights);
+
+        if (listener_) {
+            listener_->OnDetection(result);
+        }
+    }
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,137 @@
+#ifndef sonar_processing_HOGDetectorPipeline_hpp
+#define sonar_processing_HOGDetectorPipeline_hpp
+
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <base/samples/Sonar.hpp>
+#include <opencv2/opencv.hpp>
+#include "BoundedQueue.hpp"
+#include "HOGDetector.hpp"
+#include "SonarHolder.hpp"
+
+namespace sonar_processing {
+
+/**
+ * Asynchronous front-end for the HOGDetector.
+ *
+ * The preprocessing and the detection sweep run as two pipeline stages on
+ * their own threads, so the preprocessing of the frame N+1 overlaps with the
+ * detection of the frame N. Each stage is fed by a bounded queue that drops
+ * the oldest frame when it is full, which keeps the latency bounded when the
+ * frames arrive faster than the detector can handle them.
+ *
+ * While the pipeline is running, the detector must not be used by anyone else.
+ */
+class HOGDetectorPipeline {
+
+public:
+
+    struct Result {
+        Result()
+            : frame_id(0)
+            , detected(false)
+        {
+        }
+
+        uint64_t frame_id;
+        base::Time time;
+        bool detected;
+        std::vector<cv::RotatedRect> locations;
+        std::vector<double> found_weights;
+    };
+
+    class Listener {
+    public:
+        virtual ~Listener() {}
+
+        /**
+         * Called from the detection thread for every processed frame.
+         */
+        virtual void OnDetection(const Result& result) = 0;
+    };
+
+    HOGDetectorPipeline(HOGDetector& detector, size_t queue_capacity = 1);
+    ~HOGDetectorPipeline();
+
+    void Start(Listener* listener);
+
+    /**
+     * Stop the worker threads. Frames still waiting in the queues are discarded.
+     */
+    void Stop();
+
+    /**
+     * Enqueue a multibeam sample. The polar to cartesian conversion runs on the
+     * preprocessing thread.
+     * @return the frame id reported back in the result
+     */
+    uint64_t Push(const base::samples::Sonar& sample);
+
+    /**
+     * Enqueue a cartesian image. The image and the mask are copied.
+     * @return the frame id reported back in the result
+     */
+    uint64_t Push(const cv::Mat& sonar_source_image, const cv::Mat& sonar_source_mask, base::Time time = base::Time());
+
+    bool running() const {
+        return running_;
+    }
+
+    size_t dropped_frames() {
+        return input_queue_.dropped_count() + preprocessed_queue_.dropped_count();
+    }
+
+private:
+
+    struct Frame {
+        Frame()
+            : id(0)
+            , from_sample(false)
+        {
+        }
+
+        uint64_t id;
+        bool from_sample;
+        base::samples::Sonar sample;
+        base::Time time;
+        cv::Mat image;
+        cv::Mat mask;
+    };
+
+    struct PreprocessedFrame {
+        uint64_t id;
+        base::Time time;
+        cv::Mat scaled_image;
+        cv::Mat scaled_mask;
+        cv::Size source_size;
+    };
+
+    HOGDetectorPipeline(const HOGDetectorPipeline&);
+    HOGDetectorPipeline& operator=(const HOGDetectorPipeline&);
+
+    static void* PreprocessingThread(void* arg);
+    static void* DetectionThread(void* arg);
+
+    void RunPreprocessing();
+    void RunDetection();
+
+    HOGDetector& detector_;
+    Listener* listener_;
+
+    BoundedQueue<Frame> input_queue_;
+    BoundedQueue<PreprocessedFrame> preprocessed_queue_;
+
+    // used only by the preprocessing thread
+    SonarHolder sonar_holder_;
+
+    pthread_t preprocessing_thread_;
+    pthread_t detection_thread_;
+
+    uint64_t next_frame_id_;
+    bool running_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_HOGDetectorPipeline_hpp */
@@ -0,0 +1,265 @@
+#include <cmath>
+#include <algorithm>
+#include "IntegerHOG.hpp"
+
+namespace sonar_processing {
+
+// the gradient components of the gamma corrected 8 bits image
+static const int kMaxGradient = 255;
+static const int kGradientTableWidth = 2 * kMaxGradient + 1;
+
+// the cell histograms are uint16
+static const int kMaxMagnitude = 361;
+
+IntegerHOG::IntegerHOG()
+    : nbins_(0)
+    , block_histogram_size_(0)
+    , weight_scale_(1.0)
+    , bias_(0.0)
+{
+}
+
+IntegerHOG::~IntegerHOG() {
+}
+
+bool IntegerHOG::IsSupported(const cv::HOGDescriptor& hog_descriptor) {
+    return hog_descriptor.blockSize == cv::Size(hog_descriptor.cellSize.width * 2, hog_descriptor.cellSize.height * 2) &&
+        hog_descriptor.blockStride == hog_descriptor.cellSize &&
+        hog_descriptor.nbins > 0 && hog_descriptor.nbins <= 16 &&
+        hog_descriptor.cellSize.area() * kMaxMagnitude <= 0xFFFF;
+}
+
+void IntegerHOG::SetDetector(const cv::HOGDescriptor& hog_descriptor, const std::vector<float>& detector) {
+    CV_Assert(IsSupported(hog_descriptor));
+    CV_Assert(detector.size() == hog_descriptor.getDescriptorSize() + 1);
+
+    window_size_ = hog_descriptor.winSize;
+    cell_size_ = hog_descriptor.cellSize;
+    nbins_ = hog_descriptor.nbins;
+    block_histogram_size_ = 4 * nbins_;
+    window_blocks_ = cv::Size(
+        window_size_.width / cell_size_.width - 1,
+        window_size_.height / cell_size_.height - 1);
+
+    // the weights are scaled to the int8 range
+    const size_t count = detector.size() - 1;
+    float max_weight = 0;
+    for (size_t i = 0; i < count; i++) max_weight = std::max(max_weight, fabsf(detector[i]));
+
+    weight_scale_ = (max_weight > 0) ? 127.0 / max_weight : 1.0;
+    weights_.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        weights_[i] = (int8_t)cvRound(detector[i] * weight_scale_);
+    }
+
+    bias_ = detector[count];
+
+    BuildLookupTables();
+}
+
+void IntegerHOG::Release() {
+    weights_.clear();
+    bias_ = 0.0;
+}
+
+void IntegerHOG::BuildLookupTables() {
+    gamma_table_.create(1, 256, CV_8U);
+    for (int i = 0; i < 256; i++) {
+        gamma_table_.at<uchar>(i) = cv::saturate_cast<uchar>(sqrt((double)i) * 16.0);
+    }
+
+    // the orientation is unsigned, so (dx, dy) and (-dx, -dy) share the entry with dy >= 0
+    gradient_table_.resize(kGradientTableWidth * (kMaxGradient + 1));
+    for (int dy = 0; dy <= kMaxGradient; dy++) {
+        for (int dx = -kMaxGradient; dx <= kMaxGradient; dx++) {
+            double magnitude = sqrt((double)(dx * dx + dy * dy));
+            double angle = atan2((double)dy, (double)dx) * 180.0 / CV_PI;
+            int bin = (int)(angle * nbins_ / 180.0) % nbins_;
+            gradient_table_[dy * kGradientTableWidth + dx + kMaxGradient] =
+                (uint16_t)((std::min(cvRound(magnitude), kMaxMagnitude) << 4) | bin);
+        }
+    }
+}
+
+void IntegerHOG::ComputeBlocks(const cv::Mat& image, cv::Mat& blocks) const {
+    CV_Assert(image.type() == CV_8UC1);
+    CV_Assert(!empty());
+
+    const int cells_x = image.cols / cell_size_.width;
+    const int cells_y = image.rows / cell_size_.height;
+
+    if (cells_x < 2 || cells_y < 2) {
+        blocks.release();
+        return;
+    }
+
+    cv::Mat corrected;
+    cv::LUT(image, gamma_table_, corrected);
+
+    cv::Mat padded;
+    cv::copyMakeBorder(corrected, padded, 1, 1, 1, 1, cv::BORDER_REFLECT_101);
+
+    const int width = cells_x * cell_size_.width;
+    const int height = cells_y * cell_size_.height;
+
+    std::vector<int> cell_column(width);
+    for (int x = 0; x < width; x++) cell_column[x] = (x / cell_size_.width) * nbins_;
+
+    // the cell histograms, row major
+    std::vector<uint16_t> cells(cells_x * cells_y * nbins_, 0);
+    const uint16_t* table = &gradient_table_[0];
+
+    for (int y = 0; y < height; y++) {
+        const uchar* prev = padded.ptr<uchar>(y);
+        const uchar* curr = padded.ptr<uchar>(y + 1);
+        const uchar* next = padded.ptr<uchar>(y + 2);
+        uint16_t* cell_row = &cells[(y / cell_size_.height) * cells_x * nbins_];
+
+        for (int x = 0; x < width; x++) {
+            int16_t dx = (int16_t)curr[x + 2] - (int16_t)curr[x];
+            int16_t dy = (int16_t)next[x + 1] - (int16_t)prev[x + 1];
+
+            if (dy < 0) {
+                dx = -dx;
+                dy = -dy;
+            }
+
+            uint16_t entry = table[dy * kGradientTableWidth + dx + kMaxGradient];
+            cell_row[cell_column[x] + (entry & 0xF)] += entry >> 4;
+        }
+    }
+
+    // the blocks are normalized with L2-Hys, as cv::HOGDescriptor
+    const int blocks_x = cells_x - 1;
+    const int blocks_y = cells_y - 1;
+    const float epsilon = block_histogram_size_ * 0.1f * 16.0f;
+    const float clip = 0.2f;
+
+    blocks.create(blocks_y, blocks_x * block_histogram_size_, CV_8U);
+    std::vector<float> histogram(block_histogram_size_);
+
+    for (int by = 0; by < blocks_y; by++) {
+        uchar* block_row = blocks.ptr<uchar>(by);
+
+        for (int bx = 0; bx < blocks_x; bx++) {
+            // the cells of a block are in column major order
+            const uint16_t* block_cells[4] = {
+                &cells[(by * cells_x + bx) * nbins_],
+                &cells[((by + 1) * cells_x + bx) * nbins_],
+                &cells[(by * cells_x + bx + 1) * nbins_],
+                &cells[((by + 1) * cells_x + bx + 1) * nbins_]
+            };
+
+            float sum = 0;
+            for (int c = 0; c < 4; c++) {
+                for (int k = 0; k < nbins_; k++) {
+                    float value = block_cells[c][k];
+                    histogram[c * nbins_ + k] = value;
+                    sum += value * value;
+                }
+            }
+
+            float scale = 1.0f / (sqrtf(sum) + epsilon);
+            sum = 0;
+            for (int k = 0; k < block_histogram_size_; k++) {
+                float value = std::min(histogram[k] * scale, clip);
+                histogram[k] = value;
+                sum += value * value;
+            }
+
+            scale = 255.0f / (sqrtf(sum) + 1e-3f);
+            uchar* block = block_row + bx * block_histogram_size_;
+            for (int k = 0; k < block_histogram_size_; k++) {
+                block[k] = cv::saturate_cast<uchar>(histogram[k] * scale);
+            }
+        }
+    }
+}
+
+void IntegerHOG::Detect(
+    const cv::Mat& image,
+    std::vector<cv::Point>& hits,
+    std::vector<double>& weights,
+    double hit_threshold,
+    cv::Size window_stride,
+    const std::vector<cv::Point>& locations) const
+{
+    CV_Assert(window_stride.width % cell_size_.width == 0 && window_stride.height % cell_size_.height == 0);
+
+    hits.clear();
+    weights.clear();
+
+    cv::Mat blocks;
+    ComputeBlocks(image, blocks);
+
+    if (blocks.empty()) {
+        return;
+    }
+
+    const int blocks_x = blocks.cols / block_histogram_size_;
+    const int blocks_y = blocks.rows;
+    const int last_x = blocks_x - window_blocks_.width;
+    const int last_y = blocks_y - window_blocks_.height;
+
+    if (!locations.empty()) {
+        for (size_t i = 0; i < locations.size(); i++) {
+            const cv::Point& pt = locations[i];
+
+            // the windows must be aligned with the cells
+            if (pt.x % cell_size_.width != 0 || pt.y % cell_size_.height != 0) {
+                continue;
+            }
+
+            int bx = pt.x / cell_size_.width;
+            int by = pt.y / cell_size_.height;
+
+            if (bx < 0 || by < 0 || bx > last_x || by > last_y) {
+                continue;
+            }
+
+            double score = ScoreWindow(blocks, bx, by);
+            if (score >= hit_threshold) {
+                hits.push_back(pt);
+                weights.push_back(score);
+            }
+        }
+        return;
+    }
+
+    const int step_x = window_stride.width / cell_size_.width;
+    const int step_y = window_stride.height / cell_size_.height;
+
+    for (int by = 0; by <= last_y; by += step_y) {
+        for (int bx = 0; bx <= last_x; bx += step_x) {
+            double score = ScoreWindow(blocks, bx, by);
+            if (score >= hit_threshold) {
+                hits.push_back(cv::Point(bx * cell_size_.width, by * cell_size_.height));
+                weights.push_back(score);
+            }
+        }
+    }
+}
+
+double IntegerHOG::ScoreWindow(const cv::Mat& blocks, int block_x, int block_y) const {
+    const int8_t* w = &weights_[0];
+    int32_t sum = 0;
+
+    // the window blocks are in column major order
+    for (int bx = 0; bx < window_blocks_.width; bx++) {
+        for (int by = 0; by < window_blocks_.height; by++) {
+            const uchar* block = blocks.ptr<uchar>(block_y + by) + (block_x + bx) * block_histogram_size_;
+
+            int32_t dot = 0;
+            for (int k = 0; k < block_histogram_size_; k++) {
+                dot += (int32_t)block[k] * (int32_t)w[k];
+            }
+
+            sum += dot;
+            w += block_histogram_size_;
+        }
+    }
+
+    return sum / (255.0 * weight_scale_) + bias_;
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,97 @@
+#ifndef sonar_processing_IntegerHOG_hpp
+#define sonar_processing_IntegerHOG_hpp
+
+#include <stdint.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Fixed point HOG detector.
+ * It evaluates a linear detector trained with cv::HOGDescriptor using
+ * int16 gradients, a lookup table for the magnitude and orientation bin,
+ * uint16 cell histograms, uint8 normalized blocks and int8 weights.
+ * The block features are computed once per image and shared by all windows.
+ *
+ * Compared to cv::HOGDescriptor, the pixels vote only for their own cell
+ * and orientation bin, without the gaussian block weighting, so the scores
+ * are an approximation of the float detector scores.
+ * Only blocks of 2x2 cells with a stride of one cell are supported.
+ */
+class IntegerHOG {
+
+public:
+
+    IntegerHOG();
+    ~IntegerHOG();
+
+    /**
+     * Quantize a detector.
+     * @param hog_descriptor: the descriptor parameters used to train the detector
+     * @param detector: the weights followed by the bias
+     */
+    void SetDetector(const cv::HOGDescriptor& hog_descriptor, const std::vector<float>& detector);
+
+    /**
+     * Release the quantized detector, the detector is empty afterwards.
+     */
+    void Release();
+
+    bool empty() const {
+        return weights_.empty();
+    }
+
+    /**
+     * Check if a detector trained with these descriptor parameters can be quantized.
+     */
+    static bool IsSupported(const cv::HOGDescriptor& hog_descriptor);
+
+    /**
+     * Compute the quantized blocks of an image.
+     * @param image: a CV_8UC1 image
+     * @param blocks: one row per block row, with the histograms of the blocks of the row
+     */
+    void ComputeBlocks(const cv::Mat& image, cv::Mat& blocks) const;
+
+    /**
+     * Score the windows of an image, as cv::HOGDescriptor::detect without padding.
+     * @param window_stride: must be a multiple of the cell size
+     * @param locations: the window positions to score, all of them if empty
+     */
+    void Detect(
+        const cv::Mat& image,
+        std::vector<cv::Point>& hits,
+        std::vector<double>& weights,
+        double hit_threshold,
+        cv::Size window_stride,
+        const std::vector<cv::Point>& locations = std::vector<cv::Point>()) const;
+
+private:
+
+    void BuildLookupTables();
+
+    double ScoreWindow(const cv::Mat& blocks, int block_x, int block_y) const;
+
+    cv::Size window_size_;
+    cv::Size cell_size_;
+    cv::Size window_blocks_;
+    int nbins_;
+    int block_histogram_size_;
+
+    // the weights in the cv::HOGDescriptor descriptor layout
+    std::vector<int8_t> weights_;
+    double weight_scale_;
+    double bias_;
+
+    // the magnitude and bin of each gradient, as magnitude << 4 | bin,
+    // indexed by dy * 511 + dx + 255 with dy >= 0
+    std::vector<uint16_t> gradient_table_;
+
+    // the square root gamma correction, scaled to 8 bits
+    cv::Mat gamma_table_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_IntegerHOG_hpp */
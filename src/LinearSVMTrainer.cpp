@@ -0,0 +1,167 @@
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include "LinearSVMTrainer.hpp"
+
+namespace sonar_processing {
+
+// the bias is learned as the weight of a constant feature
+static const double kBiasFeature = 1.0;
+
+class SquaredNorm : public cv::ParallelLoopBody
+{
+
+public:
+
+    SquaredNorm(const cv::Mat& samples, std::vector<double>& norms)
+        : samples_(samples)
+        , norms_(norms)
+    {
+    }
+
+    void operator()(const cv::Range& range) const {
+        for (int i = range.start; i < range.end; i++) {
+            const float* x = samples_.ptr<float>(i);
+            double sum = kBiasFeature * kBiasFeature;
+            for (int j = 0; j < samples_.cols; j++) sum += (double)x[j] * x[j];
+            norms_[i] = sum;
+        }
+    }
+
+private:
+    const cv::Mat& samples_;
+    std::vector<double>& norms_;
+};
+
+LinearSVMTrainer::LinearSVMTrainer()
+    : C_(0.01)
+    , loss_type_(kHingeLoss)
+    , epsilon_(0.1)
+    , max_iterations_(1000)
+{
+}
+
+LinearSVMTrainer::~LinearSVMTrainer() {
+}
+
+void LinearSVMTrainer::Train(
+    const cv::Mat& samples,
+    const std::vector<int>& labels,
+    std::vector<float>& detector) const
+{
+    CV_Assert(samples.type() == CV_32FC1);
+    CV_Assert(samples.rows == (int)labels.size());
+
+    const int l = samples.rows;
+    const int n = samples.cols;
+
+    // the dual problem is min 0.5 a'Qa - e'a, 0 <= a_i <= U, with Q_ii += D
+    const double U = (loss_type_ == kHingeLoss) ? C_ : DBL_MAX;
+    const double D = (loss_type_ == kHingeLoss) ? 0.0 : 0.5 / C_;
+
+    // the primal weights, the last one is the bias
+    std::vector<double> w(n + 1, 0.0);
+    std::vector<double> alpha(l, 0.0);
+
+    // the diagonal of Q is computed once, in parallel
+    std::vector<double> QD(l, 0.0);
+    cv::parallel_for_(cv::Range(0, l), SquaredNorm(samples, QD));
+    for (int i = 0; i < l; i++) QD[i] += D;
+
+    std::vector<int> index(l);
+    for (int i = 0; i < l; i++) index[i] = i;
+
+    // fixed seed, so the training is deterministic
+    cv::RNG rng(0x5EED);
+
+    int active_size = l;
+    double PGmax_old = DBL_MAX;
+    double PGmin_old = -DBL_MAX;
+
+    int iter = 0;
+    while (iter < max_iterations_) {
+        double PGmax_new = -DBL_MAX;
+        double PGmin_new = DBL_MAX;
+
+        for (int i = 0; i < active_size; i++) {
+            int j = i + rng.uniform(0, active_size - i);
+            std::swap(index[i], index[j]);
+        }
+
+        for (int s = 0; s < active_size; s++) {
+            const int i = index[s];
+            const double yi = (labels[i] > 0) ? 1.0 : -1.0;
+            const float* x = samples.ptr<float>(i);
+
+            double wx = w[n] * kBiasFeature;
+            for (int k = 0; k < n; k++) wx += w[k] * x[k];
+
+            const double G = yi * wx - 1.0 + alpha[i] * D;
+
+            double PG = 0.0;
+            if (alpha[i] == 0.0) {
+                if (G > PGmax_old) {
+                    // shrink the variables that are unlikely to change
+                    active_size--;
+                    std::swap(index[s], index[active_size]);
+                    s--;
+                    continue;
+                }
+                else if (G < 0) {
+                    PG = G;
+                }
+            }
+            else if (alpha[i] == U) {
+                if (G < PGmin_old) {
+                    active_size--;
+                    std::swap(index[s], index[active_size]);
+                    s--;
+                    continue;
+                }
+                else if (G > 0) {
+                    PG = G;
+                }
+            }
+            else {
+                PG = G;
+            }
+
+            PGmax_new = std::max(PGmax_new, PG);
+            PGmin_new = std::min(PGmin_new, PG);
+
+            if (fabs(PG) > 1.0e-12) {
+                const double alpha_old = alpha[i];
+                alpha[i] = std::min(std::max(alpha[i] - G / QD[i], 0.0), U);
+
+                const double d = (alpha[i] - alpha_old) * yi;
+                for (int k = 0; k < n; k++) w[k] += d * x[k];
+                w[n] += d * kBiasFeature;
+            }
+        }
+
+        iter++;
+
+        if (PGmax_new - PGmin_new <= epsilon_) {
+            if (active_size == l) {
+                break;
+            }
+
+            // check the shrunk variables before stopping
+            active_size = l;
+            PGmax_old = DBL_MAX;
+            PGmin_old = -DBL_MAX;
+            continue;
+        }
+
+        PGmax_old = PGmax_new;
+        PGmin_old = PGmin_new;
+        if (PGmax_old <= 0) PGmax_old = DBL_MAX;
+        if (PGmin_old >= 0) PGmin_old = -DBL_MAX;
+    }
+
+    detector.resize(n + 1);
+    for (int k = 0; k < n; k++) detector[k] = (float)w[k];
+    detector[n] = (float)(w[n] * kBiasFeature);
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,90 @@
+#ifndef sonar_processing_LinearSVMTrainer_hpp
+#define sonar_processing_LinearSVMTrainer_hpp
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Primal linear SVM classifier trained with dual coordinate descent.
+ * (C.-J. Hsieh et al., "A Dual Coordinate Descent Method for Large-scale Linear SVM", ICML 2008)
+ *
+ * The weight vector is updated directly while iterating over the samples,
+ * so the training cost is linear in the number of samples and no support
+ * vectors have to be stored.
+ */
+class LinearSVMTrainer {
+
+public:
+
+    enum LossType {
+        kHingeLoss = 0,
+        kSquaredHingeLoss = 1
+    };
+
+    LinearSVMTrainer();
+    ~LinearSVMTrainer();
+
+    /**
+     * Train the classifier.
+     * @param samples: the training samples, one CV_32F row per sample
+     * @param labels: the sample labels, +1 or -1
+     * @param detector: the weights followed by the bias, in the layout used by
+     * cv::HOGDescriptor::setSVMDetector
+     */
+    void Train(
+        const cv::Mat& samples,
+        const std::vector<int>& labels,
+        std::vector<float>& detector) const;
+
+    void set_C(double C) {
+        C_ = C;
+    }
+
+    double C() const {
+        return C_;
+    }
+
+    void set_loss_type(LossType loss_type) {
+        loss_type_ = loss_type;
+    }
+
+    LossType loss_type() const {
+        return loss_type_;
+    }
+
+    void set_epsilon(double epsilon) {
+        epsilon_ = epsilon;
+    }
+
+    double epsilon() const {
+        return epsilon_;
+    }
+
+    void set_max_iterations(int max_iterations) {
+        max_iterations_ = max_iterations;
+    }
+
+    int max_iterations() const {
+        return max_iterations_;
+    }
+
+private:
+
+    // the penalty parameter
+    double C_;
+
+    // the loss function
+    LossType loss_type_;
+
+    // the stopping tolerance on the projected gradient
+    double epsilon_;
+
+    // the maximum number of passes over the samples
+    int max_iterations_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_LinearSVMTrainer_hpp */
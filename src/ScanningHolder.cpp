@@ -1,7 +1,150 @@
+#include <stdexcept>
 #include "ScanningHolder.hpp"
 
 namespace sonar_processing {
 
+// the number of cached transfer tables
+static const size_t kMaxTransferTables = 8;
+
+// computes the radius and the angle of the first quadrant, in sonar bins
+class QuadrantTable : public cv::ParallelLoopBody
+{
+
+public:
+
+    QuadrantTable(float scale_x, float scale_y, cv::Mat& radius, cv::Mat& angle)
+        : scale_x_(scale_x)
+        , scale_y_(scale_y)
+        , radius_(radius)
+        , angle_(angle)
+    {
+    }
+
+    void operator()(const cv::Range& range) const {
+        for (int j = range.start; j < range.end; j++) {
+            float* radius = radius_.ptr<float>(j);
+            float* angle = angle_.ptr<float>(j);
+            const float y = j * scale_y_;
+
+            for (int i = 0; i < radius_.cols; i++) {
+                const float x = i * scale_x_;
+                radius[i] = sqrtf(x * x + y * y);
+                angle[i] = atan2f(x, y);
+            }
+        }
+    }
+
+private:
+    float scale_x_;
+    float scale_y_;
+    cv::Mat& radius_;
+    cv::Mat& angle_;
+};
+
+// computes the transfer table rows from the first quadrant
+class TransferRows : public cv::ParallelLoopBody
+{
+
+public:
+
+    TransferRows(
+        const cv::Mat& radius,
+        const cv::Mat& angle,
+        cv::Point origin,
+        int bin_count,
+        int num_steps,
+        double left_limit,
+        double right_limit,
+        bool weighted,
+        ScanningHolder::TransferTable& table,
+        std::vector<int>& beam0,
+        std::vector<int>& beam1)
+        : radius_(radius)
+        , angle_(angle)
+        , origin_(origin)
+        , bin_count_(bin_count)
+        , num_steps_(num_steps)
+        , left_limit_(left_limit)
+        , right_limit_(right_limit)
+        , weighted_(weighted)
+        , table_(table)
+        , beam0_(beam0)
+        , beam1_(beam1)
+    {
+    }
+
+    void operator()(const cv::Range& range) const {
+        const int cols = table_.mask.cols;
+
+        for (int j = range.start; j < range.end; j++) {
+            const int dy = j - origin_.y;
+            const float* radius = radius_.ptr<float>(abs(dy));
+            const float* quadrant_angle = angle_.ptr<float>(abs(dy));
+            int* transfer = &table_.transfer[j * cols];
+            ScanningHolder::TransferWeight* weights = (weighted_) ? &table_.weights[j * cols] : NULL;
+            uchar* mask = table_.mask.ptr<uchar>(j);
+            int* beam0 = &beam0_[j * cols];
+            int* beam1 = &beam1_[j * cols];
+
+            for (int i = 0; i < cols; i++) {
+                const int dx = i - origin_.x;
+                const float r = radius[abs(dx)];
+                const float a = quadrant_angle[abs(dx)];
+
+                // atan2(-x, -y) from the first quadrant, a zero coordinate counts as positive
+                double angle = (dx < 0) ? ((dy < 0) ? a : M_PI - a) : ((dy < 0) ? -a : a - M_PI);
+
+                // pixels out the sonar image
+                if (r > bin_count_ || !r || angle < left_limit_ || angle > right_limit_) {
+                    transfer[i] = -1;
+                    mask[i] = 0;
+                    beam0[i] = -1;
+                    beam1[i] = -1;
+                }
+
+                // pixels in the sonar image
+                else {
+                    double beam = (num_steps_ - 1) * (angle + M_PI) / (2 * M_PI);
+                    int id_beam = round(beam);
+                    int bin = std::min((int)r, bin_count_ - 1);
+                    transfer[i] = id_beam * bin_count_ + bin;
+                    mask[i] = 255;
+                    beam0[i] = id_beam;
+                    beam1[i] = -1;
+
+                    // the two nearest beams and bins, the last ones are not interpolated
+                    if (weighted_) {
+                        int first_beam = std::min((int)beam, num_steps_ - 1);
+                        ScanningHolder::TransferWeight& w = weights[i];
+                        w.index = first_beam * bin_count_ + bin;
+                        w.beam_step = (first_beam < num_steps_ - 1) ? bin_count_ : 0;
+                        w.bin_step = (bin < bin_count_ - 1) ? 1 : 0;
+                        w.beam_weight = (w.beam_step) ? beam - first_beam : 0;
+                        w.bin_weight = (w.bin_step) ? r - bin : 0;
+
+                        // the pixel is repainted with both of its beams
+                        beam0[i] = first_beam;
+                        beam1[i] = (w.beam_step) ? first_beam + 1 : -1;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    const cv::Mat& radius_;
+    const cv::Mat& angle_;
+    cv::Point origin_;
+    int bin_count_;
+    int num_steps_;
+    double left_limit_;
+    double right_limit_;
+    bool weighted_;
+    ScanningHolder::TransferTable& table_;
+    std::vector<int>& beam0_;
+    std::vector<int>& beam1_;
+};
+
 // update the obstacle detection with current sonar frame
 void ScanningHolder::update(const base::samples::Sonar& sonar) {
     if (!sonar.bin_count || !(sonar.beam_count == 1))
@@ -15,32 +158,273 @@ void ScanningHolder::update(const base::samples::Sonar& sonar) {
         // set the transfer vector between image pixels and sonar data
         generateTransferTable(sonar);
 
-        // resets the accumulated sonar data
-        if (changedMotorStep || sonar.bin_count != last_sonar_.bin_count)
-            accum_data_.assign(num_steps_ * sonar.bin_count, 0.0);
+        // keep the accumulated sonar data in the new resolution
+        resampleAccumData(num_steps_, sonar.bin_count);
+        render_time_ = sonar.time;
+        drawSonarData();
     }
 
-    // add the current sonar data
+    // add the current sonar data and repaint its wedge
     if (accum_data_.size()) {
         int id_beam = round((num_steps_ - 1) * (sonar.bearings[0].rad + M_PI) / (2 * M_PI));
 
-        for (size_t i = 0; i < sonar.bin_count; ++i)
-            accum_data_[id_beam * sonar.bin_count + i] = sonar.bins[i];
+        if (id_beam >= 0 && id_beam < num_steps_) {
+            for (size_t i = 0; i < sonar.bin_count; ++i)
+                accum_data_[id_beam * sonar.bin_count + i] = sonar.bins[i];
+
+            beam_times_[id_beam] = sonar.time;
+            render_time_ = sonar.time;
+
+            // with persistence every beam fades, so the whole view is redrawn
+            if (persistence_.isNull())
+                drawBeam(id_beam);
+            else
+                drawSonarData();
+
+            trackSweep(id_beam);
+        }
     }
 
-    drawSonarData();
     last_sonar_ = sonar;
 }
 
 // draw the sector scanning data
 void ScanningHolder::drawSonarData() {
+    if (!persistence_.isNull())
+        updateBeamDecay(0, accum_steps_ - 1, render_time_);
+
+    float* image = cart_image_.ptr<float>();
     for (size_t i = 0; i < transfer_.size(); ++i) {
         if (transfer_[i] != -1) {
-            cart_image_.at<float>(i / cart_image_.cols, i % cart_image_.cols) = accum_data_[transfer_[i]];
+            image[i] = renderPixel(i);
         }
     }
 }
 
+// redraw the view faded to the given time
+void ScanningHolder::render(const base::Time& time) {
+    render_time_ = time;
+    drawSonarData();
+}
+
+// draw the pixels of a single beam
+void ScanningHolder::drawBeam(int id_beam) {
+    if (id_beam < 0 || id_beam + 1 >= (int)beam_offsets_.size())
+        return;
+
+    // the pixels of the wedge also depend on the neighbouring beams
+    if (!persistence_.isNull())
+        updateBeamDecay(id_beam - 1, id_beam + 1, render_time_);
+
+    float* image = cart_image_.ptr<float>();
+    for (int k = beam_offsets_[id_beam]; k < beam_offsets_[id_beam + 1]; ++k) {
+        int i = beam_pixels_[k];
+        image[i] = renderPixel(i);
+    }
+}
+
+// set the rendering interpolation and redraw the current data
+void ScanningHolder::setInterpolationType(int interpolation_type) {
+    if (interpolation_type != LINEAR && interpolation_type != WEIGHTED)
+        throw std::invalid_argument("the interpolation type is invalid");
+
+    if (interpolation_type == interpolation_type_)
+        return;
+
+    interpolation_type_ = interpolation_type;
+
+    if (!transfer_.empty()) {
+        generateTransferTable(last_sonar_);
+        drawSonarData();
+    }
+}
+
+// interpolate the accumulated data of one pixel
+float ScanningHolder::renderPixel(int i) const {
+    const bool decay_enabled = !persistence_.isNull();
+
+    if (interpolation_type_ != WEIGHTED) {
+        if (!decay_enabled)
+            return accum_data_[transfer_[i]];
+
+        return accum_data_[transfer_[i]] * beam_decay_[transfer_[i] / accum_bin_count_];
+    }
+
+    const TransferWeight& w = transfer_weights_[i];
+    const float* data = &accum_data_[w.index];
+
+    if (!decay_enabled) {
+        float v0 = data[0] + (data[w.bin_step] - data[0]) * w.bin_weight;
+        float v1 = data[w.beam_step] + (data[w.beam_step + w.bin_step] - data[w.beam_step]) * w.bin_weight;
+        return v0 + (v1 - v0) * w.beam_weight;
+    }
+
+    const float* decay = &beam_decay_[w.index / accum_bin_count_];
+    float v0 = (data[0] + (data[w.bin_step] - data[0]) * w.bin_weight) * decay[0];
+    float v1 = (data[w.beam_step] + (data[w.beam_step + w.bin_step] - data[w.beam_step]) * w.bin_weight) * decay[w.beam_step ? 1 : 0];
+    return v0 + (v1 - v0) * w.beam_weight;
+}
+
+// resample the accumulated data to the new number of beams and bins
+void ScanningHolder::resampleAccumData(int num_steps, int bin_count) {
+    std::vector<float> data(num_steps * bin_count, 0.0);
+    std::vector<base::Time> times(num_steps);
+
+    if (accum_steps_ && accum_bin_count_) {
+        for (int k = 0; k < num_steps; ++k) {
+            // the beams are spread over the same full circle
+            int src_beam = (num_steps > 1) ? round((double)k * (accum_steps_ - 1) / (num_steps - 1)) : 0;
+            const float* src = &accum_data_[src_beam * accum_bin_count_];
+            float* dst = &data[k * bin_count];
+
+            // the bins are spread over the same range
+            for (int b = 0; b < bin_count; ++b)
+                dst[b] = src[std::min((int)((double)b * accum_bin_count_ / bin_count), accum_bin_count_ - 1)];
+
+            times[k] = beam_times_[src_beam];
+        }
+    }
+
+    accum_data_.swap(data);
+    beam_times_.swap(times);
+    beam_decay_.assign(num_steps, 0.0);
+    accum_steps_ = num_steps;
+    accum_bin_count_ = bin_count;
+
+    // the beam indices of the current sweep are no longer valid
+    sweep_last_beam_ = -1;
+}
+
+// the exponential decay of one beam, zero if it was never received
+float ScanningHolder::beamDecay(const base::Time& beam_time, const base::Time& time) const {
+    if (persistence_.isNull())
+        return 1.0;
+
+    if (beam_time.isNull())
+        return 0.0;
+
+    double age = std::max((time - beam_time).toSeconds(), 0.0);
+    return exp(-age / persistence_.toSeconds());
+}
+
+// update the decay of a range of beams, it only depends on the beam times
+void ScanningHolder::updateBeamDecay(int first_beam, int last_beam, const base::Time& time) {
+    first_beam = std::max(first_beam, 0);
+    last_beam = std::min(last_beam, accum_steps_ - 1);
+
+    for (int k = first_beam; k <= last_beam; ++k)
+        beam_decay_[k] = beamDecay(beam_times_[k], time);
+}
+
+// publish the sweep when the motor reverses or wraps around
+void ScanningHolder::trackSweep(int id_beam) {
+    if (sweep_last_beam_ < 0) {
+        sweep_last_beam_ = sweep_min_beam_ = sweep_max_beam_ = id_beam;
+        sweep_direction_ = 0;
+        return;
+    }
+
+    int delta = id_beam - sweep_last_beam_;
+    if (!delta)
+        return;
+
+    bool wrapped = abs(delta) > num_steps_ / 2;
+    int direction = ((delta > 0) != wrapped) ? 1 : -1;
+
+    if (wrapped || (sweep_direction_ && direction != sweep_direction_)) {
+        publishSweep();
+        sweep_min_beam_ = sweep_max_beam_ = id_beam;
+    }
+
+    sweep_min_beam_ = std::min(sweep_min_beam_, id_beam);
+    sweep_max_beam_ = std::max(sweep_max_beam_, id_beam);
+    sweep_direction_ = direction;
+    sweep_last_beam_ = id_beam;
+}
+
+// copy the beams of the current sweep to the back buffer and swap it with the front one
+void ScanningHolder::publishSweep() {
+    const int beam_count = sweep_max_beam_ - sweep_min_beam_ + 1;
+    const base::Time time = beam_times_[sweep_last_beam_];
+
+    // the buffer is still used by a reader, leave it to the reader and allocate another one
+    if (back_sweep_.bins.refcount && *back_sweep_.bins.refcount > 1)
+        back_sweep_.bins.release();
+
+    back_sweep_.bins.create(beam_count, accum_bin_count_, CV_32F);
+    back_sweep_.bearings.resize(beam_count);
+    back_sweep_.beam_step = 2 * M_PI / (num_steps_ - 1);
+    back_sweep_.time = time;
+
+    for (int k = 0; k < beam_count; ++k) {
+        int id_beam = sweep_min_beam_ + k;
+        float decay = beamDecay(beam_times_[id_beam], time);
+        const float* src = &accum_data_[id_beam * accum_bin_count_];
+        float* dst = back_sweep_.bins.ptr<float>(k);
+
+        for (int b = 0; b < accum_bin_count_; ++b)
+            dst[b] = src[b] * decay;
+
+        back_sweep_.bearings[k] = id_beam * back_sweep_.beam_step - M_PI;
+    }
+
+    back_sweep_.beam_width = back_sweep_.bearings.back() - back_sweep_.bearings.front();
+
+    cv::AutoLock lock(sweep_mutex_);
+    std::swap(front_sweep_, back_sweep_);
+    has_sweep_ = true;
+}
+
+// the last completed sweep, its bins are shared
+bool ScanningHolder::getLastSweep(PolarSweep& sweep) const {
+    cv::AutoLock lock(sweep_mutex_);
+
+    if (!has_sweep_)
+        return false;
+
+    sweep = front_sweep_;
+    return true;
+}
+
+// fill a multibeam sample, the bins are stored beam by beam as in the scanning data
+bool ScanningHolder::PolarSweep::toSonar(base::samples::Sonar& sample) const {
+    if (bearings.size() < 2 || beam_width <= 0 || beam_width >= M_PI)
+        return false;
+
+    // the half width of the image built by SonarHolder for this fan, relative to the bin count
+    const float half_width = sin(beam_width) + 1e-4;
+
+    for (size_t k = 0; k < bearings.size(); ++k) {
+        if (fabs(bearings[k]) > M_PI_2 + 1e-4 || fabs(sin(bearings[k])) > half_width)
+            return false;
+    }
+
+    sample.time = time;
+    sample.bin_count = bins.cols;
+    sample.beam_count = bins.rows;
+    sample.beam_width = base::Angle::fromRad(beam_width);
+
+    sample.bearings.resize(bearings.size());
+    for (size_t k = 0; k < bearings.size(); ++k)
+        sample.bearings[k] = base::Angle::fromRad(bearings[k]);
+
+    sample.bins.resize(bins.rows * bins.cols);
+    for (int k = 0; k < bins.rows; ++k)
+        std::copy(bins.ptr<float>(k), bins.ptr<float>(k) + bins.cols, &sample.bins[k * bins.cols]);
+
+    return true;
+}
+
+// copy the accumulated data faded to the given time
+void ScanningHolder::getPolarData(std::vector<float>& data, const base::Time& time) const {
+    data.resize(accum_data_.size());
+    for (int k = 0; k < accum_steps_; ++k) {
+        float decay = beamDecay(beam_times_[k], time);
+        for (int b = 0; b < accum_bin_count_; ++b)
+            data[k * accum_bin_count_ + b] = accum_data_[k * accum_bin_count_ + b] * decay;
+    }
+}
+
 // check is the motor step angle size is changed
 bool ScanningHolder::isMotorStepChanged(const base::Angle& bearing) {
     base::Angle diff_step = bearing - last_sonar_.bearings[0];
@@ -65,37 +449,80 @@ bool ScanningHolder::isMotorStepChanged(const base::Angle& bearing) {
 
 // set the transfer vector between image pixels and sonar data
 void ScanningHolder::generateTransferTable(const base::samples::Sonar& sonar) {
-    transfer_.clear();
     cart_image_.setTo(0);
-    cart_mask_.setTo(0);
 
-    if (!motor_step_.rad)
+    if (!motor_step_.rad) {
+        transfer_.clear();
+        transfer_weights_.clear();
+        beam_offsets_.clear();
+        beam_pixels_.clear();
+        cart_mask_.setTo(0);
         return;
+    }
+
+    // the tables of the known configurations are reused
+    TransferTableKey key(num_steps_, sonar.bin_count, left_limit_.rad, right_limit_.rad, interpolation_type_);
+    std::map<TransferTableKey, TransferTable>::const_iterator it = transfer_tables_.find(key);
 
-    // set the origin
-    cv::Point2f origin(cart_image_.cols / 2, cart_image_.rows / 2);
+    if (it == transfer_tables_.end()) {
+        if (transfer_tables_.size() >= kMaxTransferTables)
+            transfer_tables_.clear();
 
-    for (size_t j = 0; j < cart_image_.rows; j++) {
-        for (size_t i = 0; i < cart_image_.cols; i++) {
-            // current point
-            cv::Point2f point(i - origin.x, j - origin.y);
-            point.x = point.x * (float) sonar.bin_count / (cart_image_.cols * 0.5);
-            point.y = point.y * (float) sonar.bin_count / (cart_image_.rows * 0.5);
+        TransferTable table;
+        buildTransferTable(sonar.bin_count, table);
+        it = transfer_tables_.insert(std::make_pair(key, table)).first;
+    }
 
-            double radius = sqrt(point.x * point.x + point.y * point.y);
-            double angle = atan2(-point.x, -point.y);
+    transfer_ = it->second.transfer;
+    transfer_weights_ = it->second.weights;
+    beam_offsets_ = it->second.beam_offsets;
+    beam_pixels_ = it->second.beam_pixels;
+    it->second.mask.copyTo(cart_mask_);
+}
 
-            // pixels out the sonar image
-            if(radius > sonar.bin_count || !radius || angle < left_limit_.rad || angle > right_limit_.rad)
-                transfer_.push_back(-1);
+// compute the transfer table of the current motor step and sector
+void ScanningHolder::buildTransferTable(int bin_count, TransferTable& table) const {
+    const int rows = cart_image_.rows;
+    const int cols = cart_image_.cols;
+    const cv::Point origin(cols / 2, rows / 2);
 
-            // pixels in the sonar image
-            else {
-                cart_mask_.at<uchar>(j,i) = 255;
-                int id_beam = round((num_steps_ - 1) * (angle + M_PI) / (2 * M_PI));
-                transfer_.push_back(id_beam * sonar.bin_count + radius);
-            }
-        }
+    // the radius and angle only depend on the distance to the origin along each axis
+    cv::Mat radius(origin.y + 1, origin.x + 1, CV_32F);
+    cv::Mat angle(origin.y + 1, origin.x + 1, CV_32F);
+    cv::parallel_for_(cv::Range(0, radius.rows), QuadrantTable(
+        bin_count / (cols * 0.5f), bin_count / (rows * 0.5f), radius, angle));
+
+    const bool weighted = (interpolation_type_ == WEIGHTED);
+
+    // the beams used by each pixel, the weighted pixels belong to both of their beams
+    std::vector<int> beam0(rows * cols);
+    std::vector<int> beam1(rows * cols);
+
+    table.transfer.resize(rows * cols);
+    table.weights.resize(weighted ? rows * cols : 0);
+    table.mask.create(rows, cols, CV_8U);
+    cv::parallel_for_(cv::Range(0, rows), TransferRows(
+        radius, angle, origin, bin_count, num_steps_, left_limit_.rad, right_limit_.rad, weighted, table, beam0, beam1));
+
+    // build the inverse index from each beam to its pixels
+    table.beam_offsets.assign(num_steps_ + 1, 0);
+    for (size_t i = 0; i < table.transfer.size(); ++i) {
+        if (beam0[i] != -1)
+            table.beam_offsets[beam0[i] + 1]++;
+        if (beam1[i] != -1)
+            table.beam_offsets[beam1[i] + 1]++;
+    }
+
+    for (int k = 0; k < num_steps_; ++k)
+        table.beam_offsets[k + 1] += table.beam_offsets[k];
+
+    table.beam_pixels.resize(table.beam_offsets[num_steps_]);
+    std::vector<int> next(table.beam_offsets.begin(), table.beam_offsets.end() - 1);
+    for (size_t i = 0; i < table.transfer.size(); ++i) {
+        if (beam0[i] != -1)
+            table.beam_pixels[next[beam0[i]]++] = i;
+        if (beam1[i] != -1)
+            table.beam_pixels[next[beam1[i]]++] = i;
     }
 }
 } /* namespace sonar_processing */
@@ -2,6 +2,7 @@
 #define ScanningHolder_hpp
 
 #include <stdio.h>
+#include <map>
 
 // OpenCV includes
 #include <opencv2/opencv.hpp>
@@ -15,14 +16,34 @@ namespace sonar_processing {
 class ScanningHolder {
 
 public:
+
+    enum InterpolationType {
+        LINEAR = 0,
+        WEIGHTED = 1
+    };
+
     ScanningHolder( uint width,
                     uint height)
                     : transfer_()
+                    , beam_offsets_()
+                    , beam_pixels_()
                     , accum_data_()
+                    , beam_times_()
+                    , beam_decay_()
+                    , accum_steps_(0)
+                    , accum_bin_count_(0)
                     , motor_step_(base::Angle::fromRad(0))
                     , last_diff_step_(base::Angle::fromRad(0))
                     , num_steps_(0)
                     , last_sonar_()
+                    , interpolation_type_(LINEAR)
+                    , persistence_()
+                    , render_time_()
+                    , sweep_last_beam_(-1)
+                    , sweep_direction_(0)
+                    , sweep_min_beam_(0)
+                    , sweep_max_beam_(0)
+                    , has_sweep_(false)
     {
         cart_image_ = cv::Mat::zeros(width, height, CV_32F);
         cart_mask_  = cv::Mat::zeros(width, height, CV_8U);
@@ -35,13 +56,27 @@ public:
                     base::Angle left_limit,
                     base::Angle right_limit)
                     : transfer_()
+                    , beam_offsets_()
+                    , beam_pixels_()
                     , accum_data_()
+                    , beam_times_()
+                    , beam_decay_()
+                    , accum_steps_(0)
+                    , accum_bin_count_(0)
                     , left_limit_(left_limit)
                     , right_limit_(right_limit)
                     , motor_step_(base::Angle::fromRad(0))
                     , last_diff_step_(base::Angle::fromRad(0))
                     , num_steps_(0)
                     , last_sonar_()
+                    , interpolation_type_(LINEAR)
+                    , persistence_()
+                    , render_time_()
+                    , sweep_last_beam_(-1)
+                    , sweep_direction_(0)
+                    , sweep_min_beam_(0)
+                    , sweep_max_beam_(0)
+                    , has_sweep_(false)
     {
         cart_image_ = cv::Mat::zeros(width, height, CV_32F);
         cart_mask_  = cv::Mat::zeros(width, height, CV_8U);
@@ -57,10 +92,25 @@ public:
 
     /**
      * Plot the current sonar view as a cv::Mat.
+     * The beams are faded to the time of the last sonar reading.
      * @return the sonar view
      */
     void drawSonarData();
 
+    /**
+     * Repaint only the pixels of one beam.
+     * @param id_beam - the beam index in the accumulated data
+     */
+    void drawBeam(int id_beam);
+
+    /**
+     * Redraw the sonar view with the beams faded to the given time.
+     * update already redraws the view at the time of each sonar reading,
+     * this is only needed to fade the view between readings.
+     * @param time - the reference time of the decay
+     */
+    void render(const base::Time& time);
+
     /**
      * Return the cartesian representation of current sonar data
      * @return the cartesian image
@@ -85,13 +135,157 @@ public:
         right_limit_ = right_limit;
     }
 
+    /**
+     * Define how the sonar data is rendered, LINEAR uses the nearest beam and bin,
+     * WEIGHTED interpolates between the two nearest beams and bins.
+     */
+    void setInterpolationType(int interpolation_type);
+
+    /**
+     * Define the time constant of the exponential decay of old beams, a null time disables the decay.
+     * With persistence, every sonar reading redraws the whole view instead of only its beam.
+     */
+    void setPersistence(const base::Time& persistence) {
+        persistence_ = persistence;
+
+        if (!transfer_.empty())
+            drawSonarData();
+    }
+
+    /**
+     * Return the accumulated beams faded to the given time.
+     * @param data - the beams, getNumSteps() beams of the bin count of the last sonar reading
+     * @param time - the reference time of the decay
+     */
+    void getPolarData(std::vector<float>& data, const base::Time& time) const;
+
+    /**
+     * Return the time each accumulated beam was received, null if it was not received.
+     */
+    const std::vector<base::Time>& getBeamTimes() const {
+        return beam_times_;
+    }
+
+    /**
+     * A completed sweep in polar coordinates.
+     * The bins are shared with the holder and other readers, they must not be modified.
+     */
+    struct PolarSweep {
+        /* the faded beams, one row of bins per beam, CV_32F */
+        cv::Mat bins;
+
+        /* the bearing of each beam, in radians */
+        std::vector<float> bearings;
+
+        /* the angle covered by the sweep, from the first to the last bearing, in radians */
+        float beam_width;
+
+        /* the angular spacing between two consecutive beams, in radians */
+        float beam_step;
+
+        /* the time of the last beam */
+        base::Time time;
+
+        /**
+         * Fill a multibeam sample with the sweep, to be used by the SonarHolder based pipelines.
+         * SonarHolder only draws a forward fan with its origin on the bottom row of an image
+         * extending bin_count * sin(beam_width) on each side of the origin. The sweep is
+         * supported if all of its bearings lie within [-90, 90] degrees and fit that width:
+         * a sector centered on the forward direction fits up to 120 degrees, and full
+         * circle or backward sweeps are never supported.
+         * @param sample - the sonar sample, unchanged if the sweep is not supported
+         * @return false if the sweep cannot be drawn by SonarHolder
+         */
+        bool toSonar(base::samples::Sonar& sample) const;
+    };
+
+    /**
+     * Return the last completed sweep, a sweep is completed when the motor
+     * reverses at a sector limit or wraps around the full circle.
+     * It can be called from another thread than update.
+     * @param sweep - the last sweep
+     * @return false if no sweep was completed yet
+     */
+    bool getLastSweep(PolarSweep& sweep) const;
+
+    /**
+     * Return the number of accumulated beams.
+     */
+    int getNumSteps() const {
+        return accum_steps_;
+    }
+
+    /* the bilinear interpolation of one pixel between two beams and two bins */
+    struct TransferWeight {
+        int index;
+        int beam_step;
+        int bin_step;
+        float beam_weight;
+        float bin_weight;
+    };
+
+    /* the transfer table of one scanning configuration */
+    struct TransferTable {
+        std::vector<int> transfer;
+        std::vector<TransferWeight> weights;
+        std::vector<int> beam_offsets;
+        std::vector<int> beam_pixels;
+        cv::Mat mask;
+    };
+
 private:
+    /* the scanning configuration of a transfer table */
+    struct TransferTableKey {
+        TransferTableKey(int num_steps, int bin_count, double left_limit, double right_limit, int interpolation_type)
+            : num_steps(num_steps)
+            , bin_count(bin_count)
+            , left_limit(left_limit)
+            , right_limit(right_limit)
+            , interpolation_type(interpolation_type)
+        {
+        }
+
+        bool operator<(const TransferTableKey& other) const {
+            if (interpolation_type != other.interpolation_type) return interpolation_type < other.interpolation_type;
+            if (num_steps != other.num_steps) return num_steps < other.num_steps;
+            if (bin_count != other.bin_count) return bin_count < other.bin_count;
+            if (left_limit != other.left_limit) return left_limit < other.left_limit;
+            return right_limit < other.right_limit;
+        }
+
+        int num_steps;
+        int bin_count;
+        double left_limit;
+        double right_limit;
+        int interpolation_type;
+    };
+
+    /* the transfer tables already computed */
+    std::map<TransferTableKey, TransferTable> transfer_tables_;
+
     /* the transfer vector between image pixels and sonar data */
     std::vector<int> transfer_;
 
+    /* the interpolation weights of each image pixel, used by the weighted rendering */
+    std::vector<TransferWeight> transfer_weights_;
+
+    /* the image pixels of each beam, beam_pixels_[beam_offsets_[id_beam]..beam_offsets_[id_beam + 1]) */
+    std::vector<int> beam_offsets_;
+    std::vector<int> beam_pixels_;
+
     /* the accumulated data to be display on sonar view */
     std::vector<float> accum_data_;
 
+    /* the time of each accumulated beam */
+    std::vector<base::Time> beam_times_;
+
+    /* the decay of each accumulated beam at the last sonar reading */
+    std::vector<float> beam_decay_;
+
+    /* the number of beams and bins of the accumulated data */
+    int accum_steps_;
+    int accum_bin_count_;
+
     /* the view of accumulated sonar readings */
     cv::Mat cart_image_;
 
@@ -110,6 +304,28 @@ private:
     /* the previous sonar reading */
     base::samples::Sonar last_sonar_;
 
+    /* the rendering interpolation */
+    int interpolation_type_;
+
+    /* the time constant of the beam decay */
+    base::Time persistence_;
+
+    /* the reference time of the decay of the view, the last sonar reading by default */
+    base::Time render_time_;
+
+    /* the beams received in the current sweep */
+    int sweep_last_beam_;
+    int sweep_direction_;
+    int sweep_min_beam_;
+    int sweep_max_beam_;
+
+    /* the last completed sweep and the buffer of the next one */
+    PolarSweep front_sweep_, back_sweep_;
+    bool has_sweep_;
+
+    /* protects the last completed sweep */
+    mutable cv::Mutex sweep_mutex_;
+
 protected:
     /**
     * Checks if the motor step angle size changed.
@@ -123,6 +339,54 @@ protected:
     * @param sonar - the sonar data
     */
     void generateTransferTable(const base::samples::Sonar& sonar);
+
+    /**
+    * Computes the transfer table of the current motor step and sector scan.
+    * @param bin_count - the number of bins of each beam
+    * @param table - the transfer table
+    */
+    void buildTransferTable(int bin_count, TransferTable& table) const;
+
+    /**
+    * Computes the value of one image pixel from the accumulated data.
+    * @param i - the pixel index
+    * @return the pixel value
+    */
+    float renderPixel(int i) const;
+
+    /**
+    * Resamples the accumulated data and beam times to a new motor step or bin count.
+    * @param num_steps - the new number of beams
+    * @param bin_count - the new number of bins
+    */
+    void resampleAccumData(int num_steps, int bin_count);
+
+    /**
+    * Computes the decay of the beam received at beam_time.
+    * @param beam_time - the time the beam was received
+    * @param time - the reference time
+    * @return the decay factor
+    */
+    float beamDecay(const base::Time& beam_time, const base::Time& time) const;
+
+    /**
+    * Updates the decay of a range of accumulated beams.
+    * @param first_beam - the first beam, clipped to the accumulated beams
+    * @param last_beam - the last beam, clipped to the accumulated beams
+    * @param time - the reference time
+    */
+    void updateBeamDecay(int first_beam, int last_beam, const base::Time& time);
+
+    /**
+    * Follows the motor direction and publishes the sweep when it is completed.
+    * @param id_beam - the beam just received
+    */
+    void trackSweep(int id_beam);
+
+    /**
+    * Copies the beams of the current sweep to a new snapshot and publishes it.
+    */
+    void publishSweep();
 };
 
 } /* namespace sonar_processing */
@@ -99,6 +99,39 @@ void SonarImagePreprocessing::Apply(
         roi_line);
 }
 
+void SonarImagePreprocessing::ApplyScaled(
+    const cv::Mat& source_image,
+    const cv::Mat& source_mask,
+    cv::Mat& preprocessed_image,
+    cv::Mat& result_mask,
+    double scale_factor) const
+{
+    cv::Mat scaled_image;
+    cv::Mat scaled_mask;
+    cv::resize(source_image, scaled_image, cv::Size(), scale_factor, scale_factor);
+    cv::resize(source_mask, scaled_mask, cv::Size(), scale_factor, scale_factor);
+
+    cv::Mat roi_cart;
+    uint32_t roi_line;
+
+    ExtractROI(
+        scaled_image,
+        scaled_mask,
+        roi_cart,
+        roi_line,
+        roi_extract_thresh_,
+        cvRound(roi_extract_start_bin_ * scale_factor),
+        scaled_image.rows-1);
+
+    PerformPreprocessing(
+        scaled_image,
+        roi_cart,
+        preprocessed_image,
+        result_mask,
+        1.0,
+        roi_line);
+}
+
 void SonarImagePreprocessing::PerformPreprocessing(
     const cv::Mat& source_cart_image,
     const cv::Mat& source_cart_mask,
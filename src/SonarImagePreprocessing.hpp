@@ -33,6 +33,18 @@ public:
         cv::Mat& result_mask,
         float scale_factor=1.0) const;
 
+    /**
+     * Scale the source image and run the preprocessing at the scaled size.
+     * The result is not scaled back and the roi extract start bin is scaled
+     * with the image, so the cost drops with the square of the scale factor.
+     */
+    void ApplyScaled(
+        const cv::Mat& source_image,
+        const cv::Mat& source_mask,
+        cv::Mat& preprocessed_image,
+        cv::Mat& result_mask,
+        double scale_factor) const;
+
     void set_mean_filter_ksize(int mean_filter_ksize) {
         mean_filter_ksize_ = mean_filter_ksize;
     }
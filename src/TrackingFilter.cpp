@@ -0,0 +1,153 @@
+#include <cmath>
+#include <algorithm>
+#include "TrackingFilter.hpp"
+
+namespace sonar_processing {
+
+// the state is (x, y, angle, vx, vy, vangle) and the measurement is (x, y, angle)
+static const int kStateSize = 6;
+static const int kMeasurementSize = 3;
+
+TrackingFilter::TrackingFilter()
+    : kalman_filter_(kStateSize, kMeasurementSize, 0, CV_32F)
+    , initialized_(false)
+    , position_noise_(2.0)
+    , angle_noise_(1.0)
+    , position_measurement_noise_(4.0)
+    , angle_measurement_noise_(3.0)
+{
+    cv::setIdentity(kalman_filter_.transitionMatrix);
+    for (int i = 0; i < kMeasurementSize; i++) {
+        kalman_filter_.transitionMatrix.at<float>(i, i + kMeasurementSize) = 1.0f;
+    }
+
+    kalman_filter_.measurementMatrix = cv::Mat::zeros(kMeasurementSize, kStateSize, CV_32F);
+    for (int i = 0; i < kMeasurementSize; i++) {
+        kalman_filter_.measurementMatrix.at<float>(i, i) = 1.0f;
+    }
+}
+
+TrackingFilter::TrackingFilter(const TrackingFilter& other)
+    : kalman_filter_(kStateSize, kMeasurementSize, 0, CV_32F)
+{
+    *this = other;
+}
+
+TrackingFilter::~TrackingFilter() {
+}
+
+TrackingFilter& TrackingFilter::operator=(const TrackingFilter& other) {
+    if (this == &other) {
+        return *this;
+    }
+
+    // the kalman filter matrices are updated in place, so they must not be shared
+    const cv::KalmanFilter& src = other.kalman_filter_;
+    cv::KalmanFilter& dst = kalman_filter_;
+    dst.statePre = src.statePre.clone();
+    dst.statePost = src.statePost.clone();
+    dst.transitionMatrix = src.transitionMatrix.clone();
+    dst.controlMatrix = src.controlMatrix.clone();
+    dst.measurementMatrix = src.measurementMatrix.clone();
+    dst.processNoiseCov = src.processNoiseCov.clone();
+    dst.measurementNoiseCov = src.measurementNoiseCov.clone();
+    dst.errorCovPre = src.errorCovPre.clone();
+    dst.gain = src.gain.clone();
+    dst.errorCovPost = src.errorCovPost.clone();
+    dst.temp1 = src.temp1.clone();
+    dst.temp2 = src.temp2.clone();
+    dst.temp3 = src.temp3.clone();
+    dst.temp4 = src.temp4.clone();
+    dst.temp5 = src.temp5.clone();
+
+    size_ = other.size_;
+    initialized_ = other.initialized_;
+    position_noise_ = other.position_noise_;
+    angle_noise_ = other.angle_noise_;
+    position_measurement_noise_ = other.position_measurement_noise_;
+    angle_measurement_noise_ = other.angle_measurement_noise_;
+    return *this;
+}
+
+void TrackingFilter::Reset(const cv::RotatedRect& location) {
+    SetupNoise();
+
+    kalman_filter_.statePost = cv::Mat::zeros(kStateSize, 1, CV_32F);
+    kalman_filter_.statePost.at<float>(0) = location.center.x;
+    kalman_filter_.statePost.at<float>(1) = location.center.y;
+    kalman_filter_.statePost.at<float>(2) = location.angle;
+
+    // the initial velocity is unknown, as large as one measurement error per frame
+    kalman_filter_.errorCovPost = cv::Mat::zeros(kStateSize, kStateSize, CV_32F);
+    for (int i = 0; i < kMeasurementSize; i++) {
+        float sigma = (i < 2) ? position_measurement_noise_ : angle_measurement_noise_;
+        kalman_filter_.errorCovPost.at<float>(i, i) = sigma * sigma;
+        kalman_filter_.errorCovPost.at<float>(i + kMeasurementSize, i + kMeasurementSize) = sigma * sigma;
+    }
+
+    kalman_filter_.statePost.copyTo(kalman_filter_.statePre);
+    kalman_filter_.errorCovPost.copyTo(kalman_filter_.errorCovPre);
+
+    size_ = location.size;
+    initialized_ = true;
+}
+
+void TrackingFilter::Clear() {
+    initialized_ = false;
+}
+
+cv::RotatedRect TrackingFilter::Predict() {
+    CV_Assert(initialized_);
+
+    const cv::Mat& state = kalman_filter_.predict();
+    return cv::RotatedRect(
+        cv::Point2f(state.at<float>(0), state.at<float>(1)),
+        size_,
+        state.at<float>(2));
+}
+
+void TrackingFilter::Correct(const cv::RotatedRect& location) {
+    CV_Assert(initialized_);
+
+    // a box is the same after 180 degrees, use the angle closest to the prediction
+    float predicted_angle = kalman_filter_.statePre.at<float>(2);
+    float angle = location.angle;
+    while (angle - predicted_angle > 90.0f) angle -= 180.0f;
+    while (angle - predicted_angle < -90.0f) angle += 180.0f;
+
+    cv::Mat measurement = (cv::Mat_<float>(kMeasurementSize, 1) << location.center.x, location.center.y, angle);
+    kalman_filter_.correct(measurement);
+
+    // keep the track angle in the range of the detections
+    kalman_filter_.statePost.at<float>(2) += location.angle - angle;
+
+    size_ = location.size;
+}
+
+double TrackingFilter::position_stddev() const {
+    const cv::Mat& P = kalman_filter_.errorCovPre;
+    return sqrt(std::max(P.at<float>(0, 0), P.at<float>(1, 1)));
+}
+
+double TrackingFilter::angle_stddev() const {
+    return sqrt(kalman_filter_.errorCovPre.at<float>(2, 2));
+}
+
+void TrackingFilter::SetupNoise() {
+    // discrete white noise acceleration model with one frame steps
+    kalman_filter_.processNoiseCov = cv::Mat::zeros(kStateSize, kStateSize, CV_32F);
+    for (int i = 0; i < kMeasurementSize; i++) {
+        float q = (i < 2) ? position_noise_ * position_noise_ : angle_noise_ * angle_noise_;
+        kalman_filter_.processNoiseCov.at<float>(i, i) = 0.25f * q;
+        kalman_filter_.processNoiseCov.at<float>(i, i + kMeasurementSize) = 0.5f * q;
+        kalman_filter_.processNoiseCov.at<float>(i + kMeasurementSize, i) = 0.5f * q;
+        kalman_filter_.processNoiseCov.at<float>(i + kMeasurementSize, i + kMeasurementSize) = q;
+    }
+
+    kalman_filter_.measurementNoiseCov = cv::Mat::zeros(kMeasurementSize, kMeasurementSize, CV_32F);
+    kalman_filter_.measurementNoiseCov.at<float>(0, 0) = position_measurement_noise_ * position_measurement_noise_;
+    kalman_filter_.measurementNoiseCov.at<float>(1, 1) = position_measurement_noise_ * position_measurement_noise_;
+    kalman_filter_.measurementNoiseCov.at<float>(2, 2) = angle_measurement_noise_ * angle_measurement_noise_;
+}
+
+} /* namespace sonar_processing */
@@ -0,0 +1,90 @@
+#ifndef sonar_processing_TrackingFilter_hpp
+#define sonar_processing_TrackingFilter_hpp
+
+#include <opencv2/opencv.hpp>
+
+namespace sonar_processing {
+
+/**
+ * Constant velocity Kalman filter on the center and the angle of a
+ * rotated detection, stepped once per frame.
+ * The predicted uncertainty is used to size the tracking search region.
+ */
+class TrackingFilter {
+
+public:
+
+    TrackingFilter();
+    TrackingFilter(const TrackingFilter& other);
+    ~TrackingFilter();
+
+    TrackingFilter& operator=(const TrackingFilter& other);
+
+    /**
+     * Start a new track at the location, with zero velocity.
+     */
+    void Reset(const cv::RotatedRect& location);
+
+    /**
+     * Forget the current track.
+     */
+    void Clear();
+
+    /**
+     * Advance the track by one frame.
+     * @return the predicted location, with the size of the last measurement
+     */
+    cv::RotatedRect Predict();
+
+    /**
+     * Update the track with the location detected after Predict.
+     */
+    void Correct(const cv::RotatedRect& location);
+
+    bool initialized() const {
+        return initialized_;
+    }
+
+    // the predicted standard deviation of the center, in pixels
+    double position_stddev() const;
+
+    // the predicted standard deviation of the angle, in degrees
+    double angle_stddev() const;
+
+    // the acceleration noise of the center, in pixels per frame squared
+    void set_position_noise(double position_noise) {
+        position_noise_ = position_noise;
+    }
+
+    // the acceleration noise of the angle, in degrees per frame squared
+    void set_angle_noise(double angle_noise) {
+        angle_noise_ = angle_noise;
+    }
+
+    // the standard deviation of the detected center, in pixels
+    void set_position_measurement_noise(double position_measurement_noise) {
+        position_measurement_noise_ = position_measurement_noise;
+    }
+
+    // the standard deviation of the detected angle, in degrees
+    void set_angle_measurement_noise(double angle_measurement_noise) {
+        angle_measurement_noise_ = angle_measurement_noise;
+    }
+
+private:
+
+    void SetupNoise();
+
+    cv::KalmanFilter kalman_filter_;
+    cv::Size2f size_;
+    bool initialized_;
+
+    double position_noise_;
+    double angle_noise_;
+    double position_measurement_noise_;
+    double angle_measurement_noise_;
+};
+
+} /* namespace sonar_processing */
+
+#endif /* sonar_processing_TrackingFilter_hpp */
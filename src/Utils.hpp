@@ -16,12 +16,12 @@ namespace utils {
 
 template <typename T>
 struct IndexComparator {
-    IndexComparator(std::vector<T> vec) : vec_(vec) {}
+    IndexComparator(const std::vector<T>& vec) : vec_(vec) {}
 
-    bool operator() (size_t i, size_t j) { return vec_[i]<vec_[j]; }
+    bool operator() (size_t i, size_t j) const { return vec_[i]<vec_[j]; }
 
 private:
-    std::vector<T> vec_;
+    const std::vector<T>& vec_;
 };
 
 inline cv::Rect clip_rect(const cv::Point& tl, const cv::Point& br, const cv::Point& min_tl, const cv::Point& max_br) {
@@ -88,11 +88,7 @@ inline static image_filtering::BorderFilterType border_filter_type(const std::st
 
 inline size_t find_best_weight_location_index(const std::vector<double>& weights)
 {
-    std::vector<size_t> indices(weights.size());
-    for (size_t i = 0; i < indices.size(); i++) indices[i]=i;
-    std::sort(indices.begin(), indices.end(), sonar_processing::utils::IndexComparator<double>(weights));
-    std::reverse(indices.begin(), indices.end());
-    return indices[0];
+    return std::max_element(weights.begin(), weights.end()) - weights.begin();
 }
 
 namespace now {